@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+
+
+// Picks a quality level for real-time playback from the time it took to
+// render each block relative to the block's duration. Going down is quick,
+// so that playback doesn't underrun; going up needs a long stretch of low
+// load, and the wait doubles whenever a step up has to be taken back soon
+// after, so the level doesn't flap.
+class AdaptiveQuality {
+public:
+    enum {
+        LEVELS     = 4,
+        HOLD_MIN   = 200,  // blocks of low load before stepping up
+        HOLD_MAX   = 6400,
+    };
+    static constexpr float LOAD_PANIC = 0.9f; // a single block this slow steps down at once
+    static constexpr float LOAD_HIGH  = 0.6f;
+    static constexpr float LOAD_LOW   = 0.3f;
+
+    explicit AdaptiveQuality(int level) : m_level(level) {}
+
+    int   level() const { return m_level; }
+    float load() const { return m_load; }
+
+    // returns the level to use from now on
+    int update(double render_time, double block_time) {
+        float load = render_time / block_time;
+        m_load += (load - m_load) * 0.1f;
+        ++m_since_change;
+
+        if ((load > LOAD_PANIC || m_load > LOAD_HIGH) && m_level > 0) {
+            // we just went up and it was too much
+            if (m_went_up && m_since_change < m_hold) m_hold = std::min<int>(m_hold * 2, HOLD_MAX);
+            change(m_level - 1, false);
+            m_load = std::min(m_load, LOAD_HIGH);
+        }
+        else if (m_load < LOAD_LOW && m_level < LEVELS - 1 && m_since_change >= m_hold) {
+            change(m_level + 1, true);
+        }
+        else if (m_went_up && m_since_change >= m_hold * 4) {
+            // the last step up held, so be quicker next time
+            m_hold    = std::max<int>(m_hold / 2, HOLD_MIN);
+            m_went_up = false;
+        }
+        return m_level;
+    }
+
+private:
+    void change(int level, bool up) {
+        m_level        = level;
+        m_went_up      = up;
+        m_since_change = 0;
+    }
+
+    int   m_level;
+    float m_load         = 0;
+    int   m_since_change = 0;
+    int   m_hold         = HOLD_MIN;
+    bool  m_went_up      = false;
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <algorithm>
+
+#include "vgm.hpp"
+
+
+// Statistics of the command stream of songs, gathered by VGM::scan without
+// rendering anything: which commands a song uses, how often it writes to each
+// chip, how long it waits, and how dense the writes get. The analyses of
+// several songs can be added up with merge.
+class Analysis {
+public:
+    enum {
+        WINDOW       = MIXRATE / 100, // for the peak write density
+        WAIT_BUCKETS = 17,            // wait lengths by powers of two: 0, 1, 2-3, ..., 32768-65535
+    };
+    enum WaitType { WAIT_61, WAIT_62, WAIT_63, WAIT_7N, WAIT_8N, WAIT_TYPES };
+
+    // a command and the wait it caused
+    void command(uint8_t cmd, uint32_t wait) {
+        ++m_commands[cmd];
+        int type = cmd == 0x61 ? WAIT_61 : cmd == 0x62 ? WAIT_62 : cmd == 0x63 ? WAIT_63 :
+                   (cmd & 0xf0) == 0x70 ? WAIT_7N : (cmd & 0xf0) == 0x80 ? WAIT_8N : WAIT_TYPES;
+        if (type == WAIT_TYPES) return;
+        Waits& w = m_waits[type];
+        ++w.count;
+        w.samples += wait;
+        ++w.buckets[bucket(wait)];
+    }
+
+    // a register write at time, in samples. times must not decrease
+    void write(int chip, bool hi, uint8_t reg, uint64_t time) {
+        ++m_writes[chip][hi][reg >> 4];
+        while (!m_window.empty() && m_window.front() + WINDOW <= time) m_window.pop_front();
+        m_window.push_back(time);
+        if (m_window.size() > m_peak) {
+            m_peak      = m_window.size();
+            m_peak_time = m_window.front();
+        }
+    }
+
+    void block(uint8_t type, uint32_t size) {
+        Blocks& b = m_blocks[type];
+        ++b.count;
+        b.bytes += size;
+        b.max    = std::max(b.max, size);
+    }
+
+    void unknown(uint8_t cmd, uint32_t offset) {
+        if (m_unknown[cmd]++ == 0) m_unknown_offset[cmd] = offset;
+    }
+
+    void finish(uint64_t samples) {
+        m_samples = samples;
+        m_files   = 1;
+        m_window.clear();
+    }
+
+    void merge(Analysis const& a) {
+        for (int i = 0; i < 256; ++i) {
+            m_commands[i] += a.m_commands[i];
+            m_unknown[i]  += a.m_unknown[i];
+            m_blocks[i].count += a.m_blocks[i].count;
+            m_blocks[i].bytes += a.m_blocks[i].bytes;
+            m_blocks[i].max    = std::max(m_blocks[i].max, a.m_blocks[i].max);
+        }
+        for (int c = 0; c < Mixer::INPUT_COUNT; ++c) {
+            for (int k = 0; k < 2 * 16; ++k) m_writes[c][k / 16][k % 16] += a.m_writes[c][k / 16][k % 16];
+        }
+        for (int t = 0; t < WAIT_TYPES; ++t) {
+            m_waits[t].count   += a.m_waits[t].count;
+            m_waits[t].samples += a.m_waits[t].samples;
+            for (int k = 0; k < WAIT_BUCKETS; ++k) m_waits[t].buckets[k] += a.m_waits[t].buckets[k];
+        }
+        m_peak     = std::max(m_peak, a.m_peak);
+        m_samples += a.m_samples;
+        m_files   += a.m_files;
+    }
+
+    // the most writes in any 10 ms
+    uint64_t peak() const { return m_peak; }
+    uint64_t writes() const {
+        uint64_t n = 0;
+        for (int c = 0; c < Mixer::INPUT_COUNT; ++c) {
+            for (int k = 0; k < 2 * 16; ++k) n += m_writes[c][k / 16][k % 16];
+        }
+        return n;
+    }
+    double seconds() const { return m_samples / double(MIXRATE); }
+
+    void print(FILE* file) const {
+        double s = std::max(seconds(), 1.0 / MIXRATE);
+        fprintf(file, "length: %.2f s\n", seconds());
+
+        fprintf(file, "commands:\n");
+        for (int i = 0; i < 256; ++i) {
+            if (m_commands[i]) fprintf(file, "  %02x: %llu\n", i, (unsigned long long)m_commands[i]);
+        }
+
+        fprintf(file, "writes: %llu, %.1f/s, peak %llu in 10 ms", (unsigned long long)writes(), writes() / s,
+                (unsigned long long)m_peak);
+        if (m_files == 1 && m_peak) fprintf(file, " at %.2f s", m_peak_time / double(MIXRATE));
+        fprintf(file, "\n");
+        for (int c = 0; c < Mixer::INPUT_COUNT; ++c) {
+            uint64_t n = 0;
+            for (int k = 0; k < 2 * 16; ++k) n += m_writes[c][k / 16][k % 16];
+            if (!n) continue;
+            fprintf(file, "  %s: %llu, %.1f/s\n", Mixer::input_name(c), (unsigned long long)n, n / s);
+            for (int k = 0; k < 2 * 16; ++k) {
+                uint64_t r = m_writes[c][k / 16][k % 16];
+                if (!r) continue;
+                fprintf(file, "    %s%02x-%02x: %llu, %.1f/s\n", k / 16 ? "hi " : "", k % 16 * 16, k % 16 * 16 + 15,
+                        (unsigned long long)r, r / s);
+            }
+        }
+
+        static char const* const WAIT_NAMES[WAIT_TYPES] = { "61", "62", "63", "7n", "8n" };
+        fprintf(file, "waits:\n");
+        for (int t = 0; t < WAIT_TYPES; ++t) {
+            Waits const& w = m_waits[t];
+            if (!w.count) continue;
+            fprintf(file, "  %s: %llu, %.2f s, mean %.1f samples\n", WAIT_NAMES[t], (unsigned long long)w.count,
+                    w.samples / double(MIXRATE), w.samples / double(w.count));
+            for (int k = 0; k < WAIT_BUCKETS; ++k) {
+                if (!w.buckets[k]) continue;
+                uint32_t lo = k ? 1u << (k - 1) : 0;
+                uint32_t hi = k ? (1u << k) - 1 : 0;
+                fprintf(file, "    %u-%u: %llu\n", lo, hi, (unsigned long long)w.buckets[k]);
+            }
+        }
+
+        fprintf(file, "data blocks:\n");
+        for (int i = 0; i < 256; ++i) {
+            Blocks const& b = m_blocks[i];
+            if (!b.count) continue;
+            fprintf(file, "  %02x: %llu, %llu bytes, max %u\n", i, (unsigned long long)b.count,
+                    (unsigned long long)b.bytes, b.max);
+        }
+
+        for (int i = 0; i < 256; ++i) {
+            if (!m_unknown[i]) continue;
+            fprintf(file, "unknown command %02x: %llu", i, (unsigned long long)m_unknown[i]);
+            if (m_files == 1) fprintf(file, " at %x", m_unknown_offset[i]);
+            fprintf(file, "\n");
+        }
+    }
+
+private:
+    struct Waits {
+        uint64_t count   = 0;
+        uint64_t samples = 0;
+        uint64_t buckets[WAIT_BUCKETS] = {};
+    };
+    struct Blocks {
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+        uint32_t max   = 0;
+    };
+
+    static int bucket(uint32_t n) {
+        int k = 0;
+        for (; n && k < WAIT_BUCKETS - 1; n >>= 1) ++k;
+        return k;
+    }
+
+    uint64_t             m_commands[256] = {};
+    uint64_t             m_writes[Mixer::INPUT_COUNT][2][16] = {}; // by port and upper register nibble
+    Waits                m_waits[WAIT_TYPES];
+    Blocks               m_blocks[256];
+    uint64_t             m_unknown[256] = {};
+    uint32_t             m_unknown_offset[256] = {};
+    std::deque<uint64_t> m_window; // the times of the writes in the last 10 ms
+    uint64_t             m_peak      = 0;
+    uint64_t             m_peak_time = 0;
+    uint64_t             m_samples   = 0;
+    uint32_t             m_files     = 0;
+};
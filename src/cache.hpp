@@ -0,0 +1,276 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// A disk cache of rendered songs. An entry is named after a hash of the song
+// file and of everything else that changes the output, and holds the float
+// output of VGM::render after a 64-byte header, so that a hit can be mapped
+// and played without emulating anything. Hits update the modification time,
+// and the least recently used entries are removed once the cache is too big.
+class RenderCache {
+public:
+    // the version of the file format. the version of the output itself is part of the key
+    enum { VERSION = 1, HEADER_SIZE = 64 };
+
+    struct Header {
+        char     magic[4]; // "VGMC"
+        uint32_t version;
+        uint64_t key;
+        uint32_t rate;
+        uint32_t channels;
+        uint64_t frames;
+        uint8_t  padding[HEADER_SIZE - 32];
+    };
+    static_assert(sizeof(Header) == HEADER_SIZE, "bad cache header");
+
+    struct Stats {
+        uint64_t hits      = 0;
+        uint64_t misses    = 0;
+        uint64_t evictions = 0;
+    };
+
+    // a mapped entry
+    class Entry {
+    public:
+        ~Entry() { if (m_map) munmap(m_map, m_size); }
+        float const* data() const { return (float const*)((uint8_t const*)m_map + HEADER_SIZE); }
+        uint64_t frames() const { return m_frames; }
+    private:
+        friend class RenderCache;
+        void*    m_map    = nullptr;
+        size_t   m_size   = 0;
+        uint64_t m_frames = 0;
+    };
+
+    // collects the output of a miss in a temporary file, which commit() moves into place
+    class Writer {
+    public:
+        ~Writer() {
+            if (!m_file) return;
+            fclose(m_file);
+            unlink(m_tmp.c_str());
+        }
+        void write(float const* buffer, uint32_t frames) {
+            if (!m_file) return;
+            m_ok &= fwrite(buffer, sizeof(float) * 2, frames, m_file) == frames;
+            m_frames += frames;
+        }
+        bool commit() {
+            if (!m_file) return false;
+            Header header = make_header(m_key, m_rate, m_frames);
+            m_ok &= fseek(m_file, 0, SEEK_SET) == 0;
+            m_ok &= fwrite(&header, sizeof(header), 1, m_file) == 1;
+            m_ok &= fclose(m_file) == 0;
+            m_file = nullptr;
+            if (m_ok) m_ok = rename(m_tmp.c_str(), m_cache->path(m_key).c_str()) == 0;
+            if (!m_ok) {
+                unlink(m_tmp.c_str());
+                return false;
+            }
+            m_cache->evict();
+            return true;
+        }
+    private:
+        friend class RenderCache;
+        RenderCache* m_cache  = nullptr;
+        FILE*        m_file   = nullptr;
+        std::string  m_tmp;
+        uint64_t     m_key    = 0;
+        uint32_t     m_rate   = 0;
+        uint64_t     m_frames = 0;
+        bool         m_ok     = true;
+    };
+
+    bool open(char const* dir, uint64_t max_bytes) {
+        mkdir(dir, 0755);
+        struct stat st;
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            printf("error: couldn't open cache directory %s\n", dir);
+            return false;
+        }
+        m_dir       = dir;
+        m_max_bytes = max_bytes;
+        return true;
+    }
+
+    // hash the song file together with a description of the render options
+    static uint64_t key(char const* filename, std::string const& options) {
+        FILE* file = fopen(filename, "rb");
+        if (!file) return 0;
+        uint64_t h = 0xcbf29ce484222325;
+        uint8_t  buf[1 << 14];
+        for (size_t n; (n = fread(buf, 1, sizeof(buf), file)) > 0;) h = hash(h, buf, n);
+        fclose(file);
+        return hash(h, options.data(), options.size());
+    }
+
+    // map the entry for key, if there is a valid one
+    bool lookup(uint64_t key, uint32_t rate, Entry& entry) {
+        std::string path = this->path(key);
+        bool hit = map(path.c_str(), key, rate, entry);
+        if (hit) utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+        update_stats(hit, !hit, 0);
+        return hit;
+    }
+
+    bool begin(uint64_t key, uint32_t rate, Writer& writer) {
+        writer.m_cache = this;
+        writer.m_key   = key;
+        writer.m_rate  = rate;
+        writer.m_tmp   = path(key) + ".tmp." + std::to_string(getpid());
+        writer.m_file  = fopen(writer.m_tmp.c_str(), "wb");
+        if (!writer.m_file) return false;
+        Header header = make_header(key, rate, 0);
+        writer.m_ok = fwrite(&header, sizeof(header), 1, writer.m_file) == 1;
+        return true;
+    }
+
+    Stats stats() { return update_stats(0, 0, 0); }
+
+    // remove the least recently used entries until the cache fits, and leftovers of aborted writes
+    void evict() {
+        struct File {
+            std::string path;
+            uint64_t    size;
+            time_t      time;
+        };
+        std::vector<File> files;
+        uint64_t          total = 0;
+        time_t            now   = time(nullptr);
+        DIR* dir = opendir(m_dir.c_str());
+        if (!dir) return;
+        while (dirent* e = readdir(dir)) {
+            std::string name = e->d_name;
+            std::string path = m_dir + "/" + name;
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            if (name.find(".pcm.tmp.") != std::string::npos) {
+                if (now - st.st_mtime > 24 * 60 * 60) unlink(path.c_str());
+                continue;
+            }
+            if (name.size() < 4 || name.compare(name.size() - 4, 4, ".pcm") != 0) continue;
+            files.push_back({ path, uint64_t(st.st_size), st.st_mtime });
+            total += st.st_size;
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end(), [](File const& a, File const& b) { return a.time < b.time; });
+        uint64_t evictions = 0;
+        for (File const& f : files) {
+            if (total <= m_max_bytes) break;
+            if (unlink(f.path.c_str()) != 0) continue;
+            total -= f.size;
+            ++evictions;
+        }
+        if (evictions) update_stats(0, 0, evictions);
+    }
+
+    // total size of all entries
+    uint64_t size() const {
+        uint64_t total = 0;
+        DIR* dir = opendir(m_dir.c_str());
+        if (!dir) return 0;
+        while (dirent* e = readdir(dir)) {
+            std::string name = e->d_name;
+            struct stat st;
+            if (name.size() < 4 || name.compare(name.size() - 4, 4, ".pcm") != 0) continue;
+            if (stat((m_dir + "/" + name).c_str(), &st) == 0) total += st.st_size;
+        }
+        closedir(dir);
+        return total;
+    }
+
+private:
+    static uint64_t hash(uint64_t h, void const* data, size_t size) {
+        auto const* p = static_cast<uint8_t const*>(data);
+        for (size_t i = 0; i < size; ++i) h = (h ^ p[i]) * 0x100000001b3;
+        return h;
+    }
+
+    static Header make_header(uint64_t key, uint32_t rate, uint64_t frames) {
+        Header header = {};
+        memcpy(header.magic, "VGMC", 4);
+        header.version  = VERSION;
+        header.key      = key;
+        header.rate     = rate;
+        header.channels = 2;
+        header.frames   = frames;
+        return header;
+    }
+
+    std::string path(uint64_t key) const {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.pcm", (unsigned long long)key);
+        return m_dir + name;
+    }
+
+    // the whole entry is read in right away, so that playing it from the audio callback
+    // doesn't wait for the disk
+    static bool map(char const* path, uint64_t key, uint32_t rate, Entry& entry) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        void* map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= HEADER_SIZE) {
+#ifdef MAP_POPULATE
+            map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+#else
+            map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+#endif
+        }
+        close(fd);
+        if (map == MAP_FAILED) return false;
+        Header const& h = *(Header const*)map;
+        if (memcmp(h.magic, "VGMC", 4) != 0 || h.version != VERSION || h.key != key || h.rate != rate
+        ||  h.channels != 2 || HEADER_SIZE + h.frames * 2 * sizeof(float) != uint64_t(st.st_size)) {
+            munmap(map, st.st_size);
+            return false;
+        }
+        madvise(map, st.st_size, MADV_WILLNEED);
+        entry.m_map    = map;
+        entry.m_size   = st.st_size;
+        entry.m_frames = h.frames;
+        return true;
+    }
+
+    // the counters live in a small text file, shared by all players using the cache
+    Stats update_stats(uint64_t hits, uint64_t misses, uint64_t evictions) {
+        Stats s;
+        std::string path = m_dir + "/stats";
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return s;
+        flock(fd, LOCK_EX);
+        char buf[128] = {};
+        ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (n > 0) {
+            unsigned long long h = 0, m = 0, e = 0;
+            sscanf(buf, "%llu %llu %llu", &h, &m, &e);
+            s = { h, m, e };
+        }
+        s.hits      += hits;
+        s.misses    += misses;
+        s.evictions += evictions;
+        if (hits || misses || evictions) {
+            int len = snprintf(buf, sizeof(buf), "%llu %llu %llu\n", (unsigned long long)s.hits,
+                               (unsigned long long)s.misses, (unsigned long long)s.evictions);
+            if (ftruncate(fd, 0) == 0) n = pwrite(fd, buf, len, 0);
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+        return s;
+    }
+
+    std::string m_dir;
+    uint64_t    m_max_bytes = 0;
+};
@@ -6,8 +6,12 @@
 
 class GA20 {
 public:
-    double sample_rate(uint32_t clock) {
-        return clock / 64;
+    // one sample every CLOCK_DIVIDER clock cycles
+    enum { CHANNELS = 4, CLOCK_DIVIDER = 64 };
+
+    void reset() {
+        m_channels = {};
+        m_data.fill(0);
     }
     void write_mem(uint32_t addr, uint8_t data) {
         if (addr < m_data.size()) m_data[addr] = data;
@@ -34,17 +38,22 @@ public:
         default: break;
         }
     }
-    void generate(int* out) {
+    // chan_out, if given, receives the stereo output of each channel
+    void generate(int* out, int* chan_out = nullptr) {
         int acc = 0;
-        for (Channel& chan : m_channels) {
-            if (!chan.enabled) continue;
-            uint8_t s = m_data[(chan.pos >> 12) & (m_data.size() - 1)];
-            if (s == 0) {
-                chan.enabled = false;
-                continue;
+        for (std::size_t i = 0; i < m_channels.size(); i++) {
+            Channel& chan = m_channels[i];
+            int x = 0;
+            if (chan.enabled) {
+                uint8_t s = m_data[(chan.pos >> 12) & (m_data.size() - 1)];
+                if (s == 0) chan.enabled = false;
+                else {
+                    x = (s - 0x80) * chan.volume;
+                    chan.pos += chan.rate;
+                }
             }
-            acc += (s - 0x80) * chan.volume;
-            chan.pos += chan.rate;
+            acc += x;
+            if (chan_out) chan_out[i * 2 + 0] = chan_out[i * 2 + 1] = x;
         }
         out[0] = acc;
         out[1] = acc;
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+
+
+// Log messages from code that must not block, like the render path in the
+// audio callback. A message is a static printf format and up to four int
+// arguments, which go into a fixed ring of records without locks or
+// allocations; any thread may push. A single normal thread drains the queue
+// and does the formatting, and shows each format at most BURST times per
+// second, so a song repeating a warning can't flood the terminal.
+//
+// Each VGM instance has its own queue, so a song that warns a lot can't push
+// out the messages of other instances; the global log_queue is for everything
+// else. The sequence number of a record is stored relative to its index, so
+// the all-zero state is an empty queue and the global queue needs no
+// constructor; a member queue is value-initialized with {}.
+class LogQueue {
+public:
+    enum { SIZE = 256, MAX_ARGS = 4, BURST = 5, FORMATS = 16 };
+
+    // returns false and counts the message as dropped if the queue is full
+    bool push(char const* fmt, int a, int b, int c, int d) {
+        uint32_t pos = m_tail.load(std::memory_order_relaxed);
+        Record*  r;
+        for (;;) {
+            r = &m_records[pos % SIZE];
+            int32_t diff = int32_t(r->seq.load(std::memory_order_acquire) + pos % SIZE - pos);
+            if (diff == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else if (diff < 0) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+        r->fmt  = fmt;
+        r->args[0] = a;
+        r->args[1] = b;
+        r->args[2] = c;
+        r->args[3] = d;
+        r->seq.store(pos + 1 - pos % SIZE, std::memory_order_release);
+        return true;
+    }
+
+    // print all pending messages, each after prefix and ": " if a prefix is given.
+    // only one thread may drain
+    void drain(FILE* file = stdout, char const* prefix = nullptr) {
+        auto now = std::chrono::steady_clock::now();
+        for (Format& f : m_formats) {
+            if (f.fmt && now - f.start >= std::chrono::seconds(1)) flush(f, file, prefix);
+        }
+        for (;;) {
+            Record& r = m_records[m_head % SIZE];
+            if (r.seq.load(std::memory_order_acquire) + m_head % SIZE != m_head + 1) break;
+            char const* fmt = r.fmt;
+            int         args[MAX_ARGS];
+            for (int i = 0; i < MAX_ARGS; ++i) args[i] = r.args[i];
+            r.seq.store(m_head + SIZE - m_head % SIZE, std::memory_order_release);
+            ++m_head;
+
+            Format& f = format(fmt, now, file, prefix);
+            for (int i = 0; i < MAX_ARGS; ++i) f.args[i] = args[i];
+            if (++f.count > BURST) continue;
+            if (prefix) fprintf(file, "%s: ", prefix);
+            fprintf(file, fmt, args[0], args[1], args[2], args[3]);
+        }
+        uint32_t dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped && prefix) fprintf(file, "%s: ", prefix);
+        if (dropped) fprintf(file, "warning: %u log messages dropped\n", dropped);
+        fflush(file);
+    }
+
+private:
+    struct Record {
+        std::atomic<uint32_t> seq;
+        char const*           fmt;
+        int                   args[MAX_ARGS];
+    };
+    // the messages of one format in the current second
+    struct Format {
+        char const*                           fmt;
+        std::chrono::steady_clock::time_point start;
+        uint32_t                              count;
+        int                                   args[MAX_ARGS];
+    };
+
+    void flush(Format& f, FILE* file, char const* prefix) {
+        if (f.count > BURST) {
+            if (prefix) fprintf(file, "%s: ", prefix);
+            fprintf(file, "(%u more) ", f.count - BURST);
+            fprintf(file, f.fmt, f.args[0], f.args[1], f.args[2], f.args[3]);
+        }
+        f.fmt = nullptr;
+    }
+
+    Format& format(char const* fmt, std::chrono::steady_clock::time_point now, FILE* file, char const* prefix) {
+        Format* oldest = &m_formats[0];
+        for (Format& f : m_formats) {
+            if (f.fmt == fmt) return f;
+            if (!f.fmt) oldest = &f;
+            else if (oldest->fmt && f.start < oldest->start) oldest = &f;
+        }
+        if (oldest->fmt) flush(*oldest, file, prefix);
+        *oldest = { fmt, now, 0, {} };
+        return *oldest;
+    }
+
+    Record                m_records[SIZE];
+    std::atomic<uint32_t> m_tail;
+    std::atomic<uint32_t> m_dropped;
+    uint32_t              m_head;
+    Format                m_formats[FORMATS];
+};
+
+inline LogQueue log_queue;
+
+// queue a message for log_queue.drain(). safe to call from the audio callback
+inline void log_message(char const* fmt, int a = 0, int b = 0, int c = 0, int d = 0) {
+    log_queue.push(fmt, a, b, c, d);
+}
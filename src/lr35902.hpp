@@ -4,7 +4,10 @@
 
 class LR35902 {
 public:
-    double sample_rate(uint32_t clock) { return clock / 4; }
+    // one sample every CLOCK_DIVIDER clock cycles
+    enum { CHANNELS = 4, CLOCK_DIVIDER = 4 };
+
+    void reset() { *this = LR35902(); }
     void write_reg(uint8_t a, uint8_t v) {
         if (a == 20) {
             m_vol[0] = ((v >> 0) & 0x7) + 1;
@@ -76,7 +79,8 @@ public:
         }
     }
 
-    void generate(int* out) {
+    // chan_out, if given, receives the stereo output of each channel
+    void generate(int* out, int* chan_out = nullptr) {
         // update pulse/wave phases
         for (int i = 0; i < 3; ++i) {
             m_freq_timer[i] += (i == 2) ? 2 : 1; // wave channel runs at twice the speed
@@ -115,36 +119,35 @@ public:
             }
         }
 
-        out[0] = out[1] = 0;
+        int x[4] = {};
 
         // pulse
         for (int i = 0; i < 2; ++i) {
             static constexpr uint8_t PULSE[] = {0b00000001, 0b10000001, 0b10000111, 0b01111110};
             Channel& chan = m_chans[i];
             if (!chan.active) continue;
-            int x = (PULSE[m_pulse_duty[i]] >> (m_phase[i] & 7)) & 1;
-            x = (x * 8 - 4) * chan.vol;
-            out[0] += x * chan.pan[0];
-            out[1] += x * chan.pan[1];
+            x[i] = (PULSE[m_pulse_duty[i]] >> (m_phase[i] & 7)) & 1;
+            x[i] = (x[i] * 8 - 4) * chan.vol;
         }
 
         // wave
-        Channel& wave = m_chans[2];
-        if (wave.active && m_wave_vol > 0) {
+        if (m_chans[2].active && m_wave_vol > 0) {
             int nibble = (m_wave_ram[(m_phase[2] >> 1) & 15] >> (m_phase[2] & 1 ? 0 : 4)) & 0xf;
-            int x = (nibble * 2 - 15) << (3 - m_wave_vol);
-            out[0] += x * wave.pan[0];
-            out[1] += x * wave.pan[1];
+            x[2] = (nibble * 2 - 15) << (3 - m_wave_vol);
         }
 
         // noise
-        Channel& noise = m_chans[3];
-        if (noise.active) {
-            int x = ((~m_noise_lfsr & 1) * 8 - 4) * noise.vol;
-            out[0] += x * noise.pan[0];
-            out[1] += x * noise.pan[1];
-        }
+        if (m_chans[3].active) x[3] = ((~m_noise_lfsr & 1) * 8 - 4) * m_chans[3].vol;
 
+        out[0] = out[1] = 0;
+        for (int i = 0; i < 4; ++i) {
+            out[0] += x[i] * m_chans[i].pan[0];
+            out[1] += x[i] * m_chans[i].pan[1];
+            if (chan_out) {
+                chan_out[i * 2 + 0] = x[i] * m_chans[i].pan[0] * m_vol[0] * 4;
+                chan_out[i * 2 + 1] = x[i] * m_chans[i].pan[1] * m_vol[1] * 4;
+            }
+        }
         out[0] *= m_vol[0] * 4;
         out[1] *= m_vol[1] * 4;
         ++m_cycle;
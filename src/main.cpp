@@ -1,463 +1,344 @@
 #include <cstdio>
 #include <vector>
-#include <fstream>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <SDL.h>
-#include <sndfile.h>
-#include <zlib.h>
 
-#include "ymfm_opm.h"
-#include "ymfm_opn.h"
-
-#include "ga20.hpp"
-#include "rf5c68.hpp"
-#include "ym2203.hpp"
-#include "lr35902.hpp"
-
-
-enum { MIXRATE = 44100 };
-
-template<class Chip>
-struct IntResampler {
-    Chip  chip;
-    int   out[2] = {};
-    float pos    = 0;
-    float step   = 0;
-    void advance() {
-        for (pos += step; pos >= 1; pos -= 1) chip.generate(out);
-    }
-    void tick(int* buf) {
-        advance();
-        buf[0] += out[0];
-        buf[1] += out[1];
-    }
-};
-
-template<class Chip, int N = 2>
-struct YmfmResampler {
-    ymfm::ymfm_interface iface;
-    ymfm::ymfm_output<N> out;
-    Chip                 chip{iface};
-    float                pos  = 0;
-    float                step = 0;
-    void init(uint32_t clock) {
-        chip.reset();
-        step = chip.sample_rate(clock) / float(MIXRATE);
-    }
-    void advance() {
-        for (pos += step; pos >= 1; pos -= 1) chip.generate(&out);
-    }
-    void tick(int* buf) {
-        advance();
-        buf[0] += out.data[0];
-        buf[1] += out.data[1];
-    }
-};
-
-class VGM {
-public:
-    bool init(char const* filename, int loop_count);
-    void use_simple_ym2203() { m_use_simple_ym2203 = true; }
-    bool done() const { return m_done; }
-    uint32_t render(float* buffer, uint32_t sample_count);
-
-private:
-    uint8_t next() {
-        if (m_pos >= m_data.size()) return 0;
-        return m_data[m_pos++];
+#include "vgm.hpp"
+#include "adaptive.hpp"
+#include "sink.hpp"
+#include "cache.hpp"
+#include "analyze.hpp"
+
+
+VGM                              vgm;
+std::unique_ptr<AdaptiveQuality> adaptive;
+std::atomic<int>                 adaptive_level;
+std::atomic<float>               adaptive_load;
+RenderCache::Entry               cached; // a cache hit is played from here
+std::atomic<uint64_t>            cached_pos;
+bool                             cache_hit;
+uint32_t                         cache_seed;
+std::unique_ptr<FrameRing>       cache_ring;     // a miss is cached from what the callback rendered
+std::atomic<bool>                cache_overflow; // the ring was full, so the entry would have a gap
+
+constexpr uint32_t CHUNK = 4096;
+
+// everything that changes the mix of a song, for the cache key
+struct RenderOptions {
+    int   loop_count = 0;
+    float fade       = 0;
+    int   quality    = 1;
+    Mixer mixer;
+
+    // loop counts below 2 all play the song once, without a fade
+    std::string key() const {
+        char str[128];
+        snprintf(str, sizeof(str), "render %d, loops %d, fade %a, quality %d, rate %d\n", int(VGM::RENDER_VERSION),
+                 std::max(loop_count, 1), loop_count > 1 ? fade : 0.0f, quality, MIXRATE);
+        return str + mixer.config();
     }
-
-    void command();
-
-    bool                 m_done;
-    bool                 m_use_simple_ym2203 = false;
-    std::vector<uint8_t> m_data;
-    uint32_t             m_pos;
-    uint32_t             m_loop_pos;
-    uint32_t             m_samples_left;
-    float                m_volume;
-    int                  m_loop_counter;
-
-    // chips
-    YmfmResampler<ymfm::ym3438>    ym2612;
-    YmfmResampler<ymfm::ym2151>    ym2151;
-    YmfmResampler<ymfm::ym2203, 4> ym2203;
-    YM2203                         ym2203_simple;
-    IntResampler<RF5C68>           rf5c68;
-    IntResampler<GA20>             ga20;
-    IntResampler<LR35902>          lr35902;
 };
 
-#pragma pack(push, 1)
-struct VGMHeader {
-    uint32_t magic;
-    uint32_t eof_offset;
-    uint32_t version;
-    uint32_t sn76489_clock;
-    uint32_t ym2413_clock;
-    uint32_t gd3_offset;
-    uint32_t total_samples;
-    uint32_t loop_offset;
-    uint32_t loop_samples;
-    uint32_t rate;
-    uint16_t sn76489_feedback;
-    uint8_t  sn76489_shift;
-    uint8_t  sn76489_flags;
-    uint32_t ym2612_clock;
-    uint32_t ym2151_clock;
-    uint32_t data_offset;
-    uint32_t _dummy_30[2];
-    uint32_t rf5c68_clock;
-    uint32_t ym2203_clock;
-    uint32_t ym2608_clock;
-    uint32_t YM2610_clock;
-    uint32_t _dummy_50[4];
-    uint32_t _dummy_60[4];
-    uint32_t _dummy_70[3];
-    uint8_t  volume_mod;
-    uint8_t  _dummy_7d;
-    uint8_t  loop_base;
-    uint8_t  loop_mod;
-    uint32_t lr35902_clock;
-    uint32_t _dummy_81[3];
-    uint32_t _dummy_90[4];
-    uint32_t _dummy_a0[4];
-    uint32_t _dummy_b0[4];
-    uint32_t _dummy_c0[4];
-    uint32_t _dummy_d0[4];
-    uint32_t ga20_clock;
-    uint32_t _dummy_e4[3];
-    uint32_t _dummy_f0[4];
-};
-#pragma pack(pop)
-
-
-bool inflate_gzip(std::vector<uint8_t>& data) {
-    if (data.size() < 2 || data[0] != 0x1f || data[1] != 0x8b) return true;
 
-    constexpr size_t CHUNK = 1 << 10;
-    std::vector<uint8_t> compressed;
-    std::swap(data, compressed);
-
-    z_stream zs = {};
-    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
-        printf("error: inflateInit\n");
-        return false;
+// measure the render time against the audio deadline and pick the quality level for the next block
+template<class T>
+void render_adaptive(T* buffer, uint32_t frames) {
+    auto start = std::chrono::steady_clock::now();
+    uint32_t n = vgm.render(buffer, frames);
+    if constexpr (std::is_same<T, float>::value) {
+        if (cache_ring && !cache_ring->push(buffer, n)) cache_overflow = true;
     }
-    zs.next_in  = compressed.data();
-    zs.avail_in = compressed.size();
-
-    size_t pos = 0;
-    do {
-        data.resize(pos + CHUNK);
-        zs.next_out  = data.data() + pos;
-        zs.avail_out = CHUNK;
-        pos += CHUNK;
-        int ret = inflate(&zs, Z_NO_FLUSH);
-        if (ret != Z_OK && ret != Z_STREAM_END) {
-            printf("error: inflate %d\n", ret);
-            inflateEnd(&zs);
-            return false;
-        }
-    } while (zs.avail_out == 0);
-    data.resize(pos - zs.avail_out);
-    inflateEnd(&zs);
-    return true;
+    if (!adaptive) return;
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+    int level = adaptive->update(time.count(), frames / double(MIXRATE));
+    if (level != vgm.quality()) vgm.set_quality(level);
+    adaptive_level = level;
+    adaptive_load  = adaptive->load();
 }
 
-bool VGM::init(char const* filename, int loop_count) {
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
-    if (!file.is_open()) {
-        printf("error: couldn't open file\n");
-        return false;
-    }
-    m_data.resize(file.tellg());
-    file.seekg(0, std::ios::beg);
-    if (!file.read(reinterpret_cast<char*>(m_data.data()), m_data.size())) {
-        printf("error: couldn't read file\n");
-        return false;
-    }
-    if (!inflate_gzip(m_data)) return false;
-
-    // parse header
-    if (m_data.size() < sizeof(VGMHeader)) {
-        printf("error: file too small\n");
-        return false;
-    }
-    VGMHeader& header = *(VGMHeader*)m_data.data();
-    if (header.magic != 0x206d6756) { // "Vgm "
-        printf("error: wrong magic\n");
-        return false;
-    }
-    printf("version = %x\n", header.version);
-    if (header.version < 0x151) {
-        printf("error: version %x too old\n", header.version);
-        return false;
-    }
-
-    m_loop_counter = loop_count;
-    m_done         = false;
-    m_pos          = 0x34 + header.data_offset;
-    m_samples_left = 0;
-    m_loop_pos     = header.loop_offset + 0x1c;
-    if (m_loop_pos == 0x1c || m_loop_pos >= m_data.size()) m_loop_pos = 0;
-
+uint32_t read_cached(float* buffer, uint32_t frames) {
+    uint32_t n = std::min<uint64_t>(frames, cached.frames() - cached_pos);
+    memcpy(buffer, cached.data() + cached_pos * 2, n * 2 * sizeof(float));
+    std::fill(buffer + n * 2, buffer + frames * 2, 0.0f);
+    cached_pos += n;
+    return n;
+}
 
-    // volume mod
-    int v = header.volume_mod;
-    if (v > 192) v = v - 192 - 63;
-    if (v == -63) --v;
-    m_volume = exp2(v / 64.0);
-    printf("volume = %f\n", m_volume);
-    m_volume *= 0.00005;
+void audio_callback(void* u, Uint8* stream, int bytes) {
+    uint32_t frames = bytes / sizeof(float) / 2;
+    if (cache_hit) read_cached((float*)stream, frames);
+    else           render_adaptive((float*)stream, frames);
+}
 
-    // init chips
-    if (header.ym2612_clock) {
-        header.ym2612_clock &= 0x7fffffff;
-        printf("ym2612 clock = %u\n", header.ym2612_clock);
-        ym2612.init(header.ym2612_clock);
-    }
-    if (header.ym2203_clock) {
-        header.ym2203_clock &= 0x3fffffff;
-        printf("ym2203 clock = %u\n", header.ym2203_clock);
-        ym2203.chip.set_fidelity(ymfm::OPN_FIDELITY_MIN);
-        ym2203.init(header.ym2203_clock);
-        ym2203_simple.set_clock(header.ym2203_clock);
-    }
-    if (header.ym2151_clock) {
-        printf("ym2151 clock = %u\n", header.ym2151_clock);
-        ym2151.init(header.ym2151_clock);
-    }
-    if (header.rf5c68_clock) {
-        printf("rf5c68 clock = %u\n", header.rf5c68_clock);
-        rf5c68.step = header.rf5c68_clock / 384.0 / float(MIXRATE);
+void audio_callback_int16(void* u, Uint8* stream, int bytes) {
+    uint32_t frames = bytes / sizeof(int16_t) / 2;
+    if (!cache_hit && !cache_ring) {
+        render_adaptive((int16_t*)stream, frames);
+        return;
     }
-    if (header.version >= 0x161 && header.lr35902_clock) {
-        printf("lr35902 clock = %u\n", header.lr35902_clock);
-        lr35902.step = lr35902.chip.sample_rate(header.lr35902_clock) / float(MIXRATE);
+    // the cache holds float samples, so they are converted here
+    int16_t* out = (int16_t*)stream;
+    for (uint32_t i = 0; i < frames; i += Mixer::BLOCK) {
+        float    tmp[Mixer::BLOCK * 2];
+        uint32_t n = std::min<uint32_t>(frames - i, Mixer::BLOCK);
+        if (cache_hit) read_cached(tmp, n);
+        else           render_adaptive(tmp, n);
+        convert_int16(tmp, out + i * 2, n * 2, cache_seed);
     }
-    if (header.version >= 0x171 && header.ga20_clock) {
-        printf("ga20 clock = %u\n", header.ga20_clock);
-        ga20.step = ga20.chip.sample_rate(header.ga20_clock) / float(MIXRATE);
-    }
-
-    return true;
 }
 
+// write what the callback rendered into the cache
+void drain_cache_ring(RenderCache::Writer& writer) {
+    float    buffer[CHUNK * 2];
+    uint32_t n;
+    while ((n = cache_ring->pop(buffer, CHUNK)) > 0) writer.write(buffer, n);
+}
 
-void VGM::command() {
-    uint8_t  cmd = next();
-    uint8_t  b   = 0;
-    uint32_t n   = 0;
-    switch (cmd) {
-    case 0xb0: // RF5C68, write value dd to register aa
-        b = next();
-        rf5c68.chip.write_reg(b, next());
-        break;
-    case 0xb3: // LR35902, write value dd to register aa
-        b = next();
-        lr35902.chip.write_reg(b, next());
-        break;
-    case 0xbf: // GA20, write value dd to register aa
-        b = next();
-        ga20.chip.write_reg(b, next());
-        break;
-    case 0x52: // YM2612 port 0, write value dd to register aa
-        ym2612.chip.write_address(next());
-        ym2612.chip.write_data(next());
-        break;
-    case 0x53: // YM2612 port 1, write value dd to register aa
-        ym2612.chip.write_address_hi(next());
-        ym2612.chip.write_data_hi(next());
-        break;
-    case 0x54: // YM2151, write value dd to register aa
-        ym2151.chip.write_address(next());
-        ym2151.chip.write_data(next());
-        break;
-    case 0x55: { // YM2203, write value dd to register aa
-        uint8_t a = next();
-        uint8_t v = next();
-        // XXX: only fm voice #0
-        //if (a < 16 || (a == 0x28 && (v & 3) != 0)) break;
-        ym2203.chip.write_address(a);
-        ym2203.chip.write_data(v);
-        ym2203_simple.write_reg(a, v);
-        break;
-    }
-    case 0x67: // data block
-        next();
-        b = next();
-        n = next();
-        n |= next() << 8;
-        n |= next() << 16;
-        n |= next() << 24;
-        if (b == 0xc0) { // rf5c68
-            uint16_t addr = next();
-            addr |= next() << 8;
-            for (; n > 2; --n) rf5c68.chip.write_mem(addr++, next());
-        }
-        else if (b == 0x93) { // ga20 rom
-            uint32_t rom = next();
-            rom |= next() << 8;
-            rom |= next() << 16;
-            rom |= next() << 24;
-            (void)rom;
-
-            uint32_t addr = next();
-            addr |= next() << 8;
-            addr |= next() << 16;
-            addr |= next() << 24;
-            for (; n > 8; --n) ga20.chip.write_mem(addr++, next());
-        }
-        else {
-            printf("warning: unknown data block %02x %04x\n", b, n);
-            m_pos += n;
+// print statistics of the commands of a song, or of each song in a directory and of all of them
+bool analyze(char const* path) {
+    std::vector<std::string> files;
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR* dir = opendir(path);
+        if (!dir) {
+            printf("error: couldn't open %s\n", path);
+            return false;
         }
-        break;
-
-    case 0x61: // wait n samples
-        m_samples_left = next();
-        m_samples_left |= next() << 8;
-        break;
-    case 0x62:
-        m_samples_left = MIXRATE / 60;
-        break;
-    case 0x63:
-        m_samples_left = MIXRATE / 50;
-        break;
-    case 0x70: case 0x71: case 0x72: case 0x73:
-    case 0x74: case 0x75: case 0x76: case 0x77:
-    case 0x78: case 0x79: case 0x7a: case 0x7b:
-    case 0x7c: case 0x7d: case 0x7e: case 0x7f:
-        m_samples_left = (cmd & 0xf) + 1;
-        break;
-
-    case 0x66: // end of sound data
-        if (m_loop_pos) {
-            m_pos = m_loop_pos;
-            if (--m_loop_counter > 0) {
-                printf("looping\n");
-                break;
-            }
+        while (dirent* e = readdir(dir)) {
+            std::string name = e->d_name;
+            if (name.size() < 4) continue;
+            std::string ext = name.substr(name.size() - 4);
+            if (ext == ".vgm" || ext == ".vgz") files.push_back(std::string(path) + "/" + name);
         }
-        printf("done\n");
-        m_done = true;
-        break;
-
-    default:
-        printf("error: unknown command %02x\n", cmd);
-        m_done = true;
-        break;
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+    }
+    else {
+        files.push_back(path);
     }
-}
 
-uint32_t VGM::render(float* buffer, uint32_t sample_count) {
-    uint32_t rendered = 0;
-    while (sample_count > 0) {
-        while (!m_done && m_samples_left == 0) command();
-        if (m_done) {
-            while (sample_count > 0) {
-                *buffer++ = 0;
-                *buffer++ = 0;
-                --sample_count;
-            }
-            return rendered;
+    struct Song {
+        std::string name;
+        uint64_t    peak;
+        double      rate;
+    };
+    std::vector<Song> songs;
+    Analysis          total;
+    for (std::string const& file : files) {
+        std::unique_ptr<VGM> v(new VGM);
+        Analysis             a;
+        printf("== %s\n", file.c_str());
+        if (!v->init(file.c_str(), 1)) {
+            printf("error: %s\n", v->error());
+            continue;
         }
-
-        uint32_t samples = std::min(sample_count, m_samples_left);
-        for (uint32_t i = 0; i < samples; ++i) {
-            int ibuf[2] = {};
-
-            ym2612.tick(ibuf);
-            ym2151.tick(ibuf);
-            rf5c68.tick(ibuf);
-            ga20.tick(ibuf);
-            lr35902.tick(ibuf);
-
-            buffer[0] = ibuf[0] * m_volume;
-            buffer[1] = ibuf[1] * m_volume;
-
-            if (m_use_simple_ym2203) {
-                ym2203_simple.render(buffer);
-            }
-            else {
-                // handle ym2203 separately to apply panning
-                ym2203.advance();
-                static const float PAN[] = {
-                    0.5f * std::sqrt(0.5f),
-                    0.5f * std::sqrt(0.5f + 0.2f),
-                    0.5f * std::sqrt(0.5f - 0.2f),
-                };
-                buffer[0] += ym2203.out.data[0] * m_volume;
-                buffer[1] += ym2203.out.data[0] * m_volume;
-                buffer[0] += ym2203.out.data[1] * PAN[0] * m_volume;
-                buffer[1] += ym2203.out.data[1] * PAN[0] * m_volume;
-                buffer[0] -= ym2203.out.data[2] * PAN[1] * m_volume;
-                buffer[1] -= ym2203.out.data[2] * PAN[2] * m_volume;
-                buffer[0] += ym2203.out.data[3] * PAN[2] * m_volume;
-                buffer[1] += ym2203.out.data[3] * PAN[1] * m_volume;
-            }
-
-            buffer += 2;
+        v->analyze(&a);
+        v->scan();
+        v->log().drain();
+        a.print(stdout);
+        total.merge(a);
+        songs.push_back({ file, a.peak(), a.writes() / std::max(a.seconds(), 1.0 / MIXRATE) });
+    }
+    if (songs.size() > 1) {
+        printf("== %zu songs\n", songs.size());
+        total.print(stdout);
+        std::sort(songs.begin(), songs.end(), [](Song const& a, Song const& b) { return a.peak > b.peak; });
+        printf("densest:\n");
+        for (size_t i = 0; i < std::min<size_t>(songs.size(), 10); ++i) {
+            printf("  %llu in 10 ms, %.1f writes/s: %s\n", (unsigned long long)songs[i].peak, songs[i].rate,
+                   songs[i].name.c_str());
         }
-
-        m_samples_left -= samples;
-        sample_count -= samples;
-        rendered += samples;
     }
-    return rendered;
-}
-
-
-
-VGM vgm;
-
-
-void audio_callback(void* u, Uint8* stream, int bytes) {
-    vgm.render((float*)stream, bytes / sizeof(float) / 2);
+    return !songs.empty();
 }
 
 
 int main(int argc, char** argv) {
-    bool wave = false;
-    bool usage = false;
-    int  loop_count = 0;
-    int  opt;
-    while ((opt = getopt(argc, argv, "wsl:")) != -1) {
+    char const*  out_path   = nullptr;
+    SampleFormat format     = SampleFormat::FLOAT;
+    bool         usage      = false;
+    int          stems      = 0;
+    bool         adapt      = false;
+    int          loop_count = 0;
+    char const*  cache_dir  = nullptr;
+    uint64_t     cache_mb   = 1024;
+    float        fade       = 0;
+    bool         analysis   = false;
+    int          opt;
+    static option const long_options[] = {
+        { "analyze", no_argument, nullptr, 'A' },
+        {},
+    };
+    while ((opt = getopt_long(argc, argv, "wo:itTsq:am:g:l:f:c:C:", long_options, nullptr)) != -1) {
         switch (opt) {
-        case 'w': wave = true; break;
-        case 's': vgm.use_simple_ym2203(); break;
+        case 'A': analysis = true; break;
+        case 'w': out_path = "out.wav"; break;
+        case 'o': out_path = optarg; break;
+        case 'i': format = SampleFormat::INT16; break;
+        case 't': stems = std::max(stems, 1); break;
+        case 'T': stems = 2; break;
+        case 's': vgm.set_quality(0); break;
+        case 'q': vgm.set_quality(std::min(std::max(atoi(optarg), 0), VGM::QUALITY_LEVELS - 1)); break;
+        case 'a': adapt = true; break;
+        case 'm': if (!vgm.mixer().load_config(optarg)) return 1; break;
+        case 'g': if (!vgm.mixer().configure(optarg)) return 1; break;
         case 'l': loop_count = atoi(optarg); break;
+        case 'f': fade = std::max(0.0, atof(optarg)); break;
+        case 'c': cache_dir = optarg; break;
+        case 'C': cache_mb = std::max(0, atoi(optarg)); break;
         default: usage = true; break;
         }
     }
+    if (stems && (!out_path || strcmp(out_path, "-") == 0)) usage = true;
     if (argc - optind != 1 || usage) {
-        printf("Usage: %s [-w] [-s] [-l loop_count] vgm-file\n", argv[0]);
+        printf("Usage: %s [-w] [-o out-file [-t|-T]] [-i] [-s] [-q quality] [-a] [-m mix-file] [-g mix-setting] [-l loop_count [-f fade_seconds]] [-c cache-dir [-C cache_mb]] vgm-file\n"
+               "       %s --analyze vgm-file|directory\n", argv[0], argv[0]);
         return 1;
     }
+    if (analysis) return analyze(argv[optind]) ? 0 : 1;
+    if (stems) vgm.enable_stems(stems == 2);
+    if (out_path) vgm.enable_loop_reuse();
+    vgm.set_fade(fade);
     char const* filename = argv[optind];
 
-    if (!vgm.init(filename, loop_count)) return 1;
+    // raw PCM to stdout: keep the real stdout for the data and send all messages to stderr
+    FILE* raw_file = nullptr;
+    if (out_path && strcmp(out_path, "-") == 0) {
+        raw_file = fdopen(dup(STDOUT_FILENO), "wb");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
 
-    if (wave) {
-        SF_INFO info = { 0, MIXRATE, 2, SF_FORMAT_WAV | SF_FORMAT_FLOAT, 0, 0 };
-        SNDFILE* f = sf_open("out.wav", SFM_WRITE, &info);
-        constexpr uint32_t CHUNK = 4096;
-        float buffer[CHUNK * 2];
-        while (!vgm.done()) {
-            uint32_t n = vgm.render(buffer, CHUNK);
-            sf_writef_float(f, buffer, n);
+    if (!vgm.init(filename, loop_count)) {
+        printf("error: %s\n", vgm.error());
+        return 1;
+    }
+    VGM::Info const& info = vgm.info();
+    printf("version = %x\n", info.version);
+    if (!info.title.empty())  printf("title = %s\n", info.title.c_str());
+    if (!info.game.empty())   printf("game = %s\n", info.game.c_str());
+    if (!info.author.empty()) printf("author = %s\n", info.author.c_str());
+    printf("volume = %f\n", info.volume);
+    if (info.ym2612_clock)  printf("ym2612 clock = %u\n", info.ym2612_clock);
+    if (info.ym2203_clock)  printf("ym2203 clock = %u\n", info.ym2203_clock);
+    if (info.ym2151_clock)  printf("ym2151 clock = %u\n", info.ym2151_clock);
+    if (info.rf5c68_clock)  printf("rf5c68 clock = %u\n", info.rf5c68_clock);
+    if (info.lr35902_clock) printf("lr35902 clock = %u\n", info.lr35902_clock);
+    if (info.ga20_clock)    printf("ga20 clock = %u\n", info.ga20_clock);
+
+    RenderOptions options;
+    options.loop_count = loop_count;
+    options.fade       = fade;
+    options.quality    = vgm.quality();
+    options.mixer      = vgm.mixer();
+
+    // the cache only holds the mix, at a fixed quality
+    RenderCache cache;
+    uint64_t    cache_key = 0;
+    if (cache_dir && !stems && !adapt) {
+        if (!cache.open(cache_dir, cache_mb << 20)) return 1;
+        cache_key = RenderCache::key(filename, options.key());
+        cache_hit = cache_key && cache.lookup(cache_key, MIXRATE, cached);
+        RenderCache::Stats st = cache.stats();
+        printf("cache %s (%llu hits, %llu misses, %llu evictions, %.1f of %llu MB)\n", cache_hit ? "hit" : "miss",
+               (unsigned long long)st.hits, (unsigned long long)st.misses, (unsigned long long)st.evictions,
+               cache.size() / double(1 << 20), (unsigned long long)cache_mb);
+    }
+
+    if (out_path) {
+        std::unique_ptr<Sink> sink;
+        if (raw_file) {
+            sink.reset(new RawSink(raw_file, format));
+        }
+        else {
+            SndfileSink* s = new SndfileSink;
+            sink.reset(s);
+            if (!s->open(out_path, MIXRATE, format)) return 1;
         }
-        sf_close(f);
+        AsyncWriter writer(*sink, CHUNK);
+
+        // stem files are named after the output file, e.g. out-ym2612.wav
+        std::vector<std::unique_ptr<SndfileSink>> stem_sinks;
+        std::vector<std::unique_ptr<AsyncWriter>> stem_writers;
+        std::vector<float*>                       stem_buffers(vgm.stem_count());
+        std::string path = out_path;
+        size_t      dot  = path.rfind('.');
+        if (dot == std::string::npos || path.find('/', dot) != std::string::npos) dot = path.size();
+        for (size_t i = 0; i < vgm.stem_count(); ++i) {
+            std::string stem_path = path.substr(0, dot) + "-" + vgm.stem_name(i) + path.substr(dot);
+            stem_sinks.emplace_back(new SndfileSink);
+            if (!stem_sinks.back()->open(stem_path.c_str(), MIXRATE, format)) return 1;
+            stem_writers.emplace_back(new AsyncWriter(*stem_sinks.back(), CHUNK));
+        }
+
+        RenderCache::Writer cache_writer;
+        if (cache_key && !cache_hit) cache.begin(cache_key, MIXRATE, cache_writer);
+
+        bool ok = true;
+        while (cache_hit && cached_pos < cached.frames()) {
+            writer.submit(read_cached(writer.buffer(), CHUNK));
+        }
+        while (!cache_hit && !vgm.done()) {
+            for (size_t i = 0; i < stem_writers.size(); ++i) stem_buffers[i] = stem_writers[i]->buffer();
+            uint32_t n = vgm.render(writer.buffer(), CHUNK, stem_buffers.data());
+            cache_writer.write(writer.buffer(), n);
+            writer.submit(n);
+            for (auto& w : stem_writers) w->submit(n);
+            vgm.log().drain();
+        }
+        for (auto& w : stem_writers) ok &= w->finish();
+        ok &= writer.finish();
+        if (!ok) {
+            printf("error: couldn't write output\n");
+            return 1;
+        }
+        if (cache_key && !cache_hit) cache_writer.commit();
         return 0;
     }
 
+    // a miss is cached from the played output, if the song is played to the end.
+    // the ring holds a few seconds, and the main loop empties it every 100 ms
+    RenderCache::Writer cache_writer;
+    if (cache_key && !cache_hit && cache.begin(cache_key, MIXRATE, cache_writer)) {
+        cache_ring.reset(new FrameRing(1 << 18));
+    }
+
     SDL_SetHint(SDL_HINT_NO_SIGNAL_HANDLERS, "1");
     SDL_Init(SDL_INIT_AUDIO);
     SDL_AudioSpec spec = { MIXRATE, AUDIO_F32, 2, 0, 1024, 0, 0, &audio_callback, nullptr };
+    if (format == SampleFormat::INT16) {
+        spec.format   = AUDIO_S16;
+        spec.callback = &audio_callback_int16;
+    }
     SDL_OpenAudio(&spec, nullptr);
+    if (adapt) adaptive.reset(new AdaptiveQuality(vgm.quality()));
+    int level = vgm.quality();
+    adaptive_level = level; // the callback only stores a level after its first block
     SDL_PauseAudio(0);
-    while (!vgm.done()) SDL_Delay(100);
+    while (cache_hit ? cached_pos < cached.frames() : !vgm.done()) {
+        SDL_Delay(100);
+        vgm.log().drain();
+        if (cache_ring) drain_cache_ring(cache_writer);
+        if (adapt && adaptive_level != level) {
+            level = adaptive_level;
+            printf("quality %d (%s), load %.0f%%\n", level, VGM::quality_name(level), adaptive_load * 100);
+        }
+    }
     SDL_CloseAudio();
     SDL_Quit();
+    vgm.log().drain();
+    if (cache_ring) {
+        drain_cache_ring(cache_writer);
+        if (!cache_overflow) cache_writer.commit();
+    }
     return 0;
 }
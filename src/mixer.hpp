@@ -0,0 +1,215 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+
+
+// convert float samples to int16 with TPDF dither.
+// the noise comes from a hash of the running sample index rather than
+// a sequential PRNG, so there is no loop-carried dependency. the loop is
+// kept free of branches and unsigned-to-float conversions so that it
+// vectorizes (check with -fopt-info-vec)
+inline void convert_int16(float const* __restrict in, int16_t* __restrict out, uint32_t count, uint32_t& seed) {
+    uint32_t const base = seed;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t h = (base + i) * 0x9e3779b1u;
+        h ^= h >> 15;
+        h *= 0x85ebca77u;
+        h ^= h >> 13;
+        float d = float(int32_t(h & 0xffff) - int32_t(h >> 16)) * (1.0f / 65536.0f);
+        // offset to [0, 65535] so that truncating rounds to nearest
+        float x = in[i] * 32767.0f + d + 32768.5f;
+        x = x < 0.0f ? 0.0f : x;
+        x = x > 65535.0f ? 65535.0f : x;
+        out[i] = int16_t(int32_t(x) - 32768);
+    }
+    seed += count;
+}
+
+
+// Each chip renders a block of planar output into its input, and the mixer
+// sums all of them through a gain/pan matrix into stereo. The loops work on
+// whole planes so that they vectorize.
+class Mixer {
+public:
+    enum { BLOCK = 256, MAX_OUTPUTS = 4 };
+    enum { YM2612, YM2151, YM2203, YM2203_SIMPLE, RF5C68, GA20, LR35902, INPUT_COUNT };
+
+    struct Input {
+        bool  active  = false;
+        int   outputs = 0;
+        float scale   = 1;  // per-file volume, applied on top of the gains
+        float gain[MAX_OUTPUTS][2] = {};
+        float buf[MAX_OUTPUTS][BLOCK];
+    };
+
+    // a stem mixes a single input, optionally from different planes,
+    // e.g. a single channel of a chip. null planes are skipped
+    struct Stem {
+        std::string  name;
+        int          input;
+        float const* planes[MAX_OUTPUTS];
+    };
+
+    static char const* input_name(int i) {
+        static char const* const NAMES[] = {
+            "ym2612", "ym2151", "ym2203", "ym2203", "rf5c68", "ga20", "lr35902",
+        };
+        return NAMES[i];
+    }
+
+    Input& input(int i) { return m_inputs[i]; }
+
+    // a config line is either "chip gain [pan]", which scales the whole chip
+    // with pan in [-1, 1], or "chip.output left right", which sets the gains
+    // of one chip output
+    bool configure(std::string const& line) {
+        std::istringstream ss(line.substr(0, line.find('#')));
+        Setting s;
+        std::string name;
+        if (!(ss >> name)) return true;
+        size_t dot = name.find('.');
+        if (dot != std::string::npos) {
+            s.output = atoi(name.c_str() + dot + 1);
+            name.resize(dot);
+        }
+        for (s.input = 0; s.input < INPUT_COUNT; ++s.input) {
+            if (name == input_name(s.input)) break;
+        }
+        if (s.input == INPUT_COUNT || s.output >= MAX_OUTPUTS) {
+            printf("error: unknown mixer input '%s'\n", name.c_str());
+            return false;
+        }
+        if (!(ss >> s.values[0]) || (!(ss >> s.values[1]) && s.output >= 0)) {
+            printf("error: invalid mixer setting '%s'\n", line.c_str());
+            return false;
+        }
+        if (s.output < 0 && ss.fail()) s.values[1] = 0;
+        m_settings.push_back(s);
+        return true;
+    }
+
+    bool load_config(char const* filename) {
+        std::ifstream file(filename);
+        if (!file.is_open()) {
+            printf("error: couldn't open mixer config %s\n", filename);
+            return false;
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!configure(line)) return false;
+        }
+        return true;
+    }
+
+    // the config in a canonical form, e.g. for a cache key
+    std::string config() const {
+        std::string str;
+        char        line[64];
+        for (Setting const& s : m_settings) {
+            snprintf(line, sizeof(line), "%d.%d %a %a\n", s.input, s.output, s.values[0], s.values[1]);
+            str += line;
+        }
+        return str;
+    }
+
+    // set up an input with its default gains, then apply the config
+    void activate(int i, int outputs, float scale, float const (*gain)[2]) {
+        Input& in = m_inputs[i];
+        in.active  = true;
+        in.outputs = outputs;
+        in.scale   = scale;
+        for (int k = 0; k < outputs; ++k) {
+            in.gain[k][0] = gain[k][0];
+            in.gain[k][1] = gain[k][1];
+        }
+        // inputs sharing a name share the config
+        for (Setting const& s : m_settings) {
+            if (strcmp(input_name(s.input), input_name(i)) != 0) continue;
+            if (s.output >= outputs) continue;
+            if (s.output >= 0) {
+                in.gain[s.output][0] = s.values[0];
+                in.gain[s.output][1] = s.values[1];
+                continue;
+            }
+            float pan = std::min(std::max(s.values[1], -1.0f), 1.0f);
+            for (int k = 0; k < outputs; ++k) {
+                in.gain[k][0] *= s.values[0] * std::min(1.0f, 1.0f - pan);
+                in.gain[k][1] *= s.values[0] * std::min(1.0f, 1.0f + pan);
+            }
+        }
+    }
+
+    void mix(float* out, uint32_t n) {
+        clear(n);
+        for (Input const& in : m_inputs) {
+            if (!in.active) continue;
+            float const* planes[MAX_OUTPUTS];
+            for (int k = 0; k < in.outputs; ++k) planes[k] = in.buf[k];
+            accumulate(in, planes, n);
+        }
+        interleave(out, n);
+    }
+
+    // hand out a mixed block
+    void output(float const* in, float* out, uint32_t n) {
+        std::copy(in, in + n * 2, out);
+    }
+    void output(float const* in, int16_t* out, uint32_t n) {
+        convert_int16(in, out, n * 2, m_seed);
+    }
+
+    void mix_stem(Stem const& stem, float* out, uint32_t n) {
+        clear(n);
+        accumulate(m_inputs[stem.input], stem.planes, n);
+        interleave(out, n);
+    }
+
+private:
+    struct Setting {
+        int   input     = 0;
+        int   output    = -1;
+        float values[2] = { 1, 0 };
+    };
+
+    void clear(uint32_t n) {
+        std::fill(m_left, m_left + n, 0.0f);
+        std::fill(m_right, m_right + n, 0.0f);
+    }
+
+    void accumulate(Input const& in, float const* const* planes, uint32_t n) {
+        float* __restrict left  = m_left;
+        float* __restrict right = m_right;
+        for (int k = 0; k < in.outputs; ++k) {
+            float const* __restrict p = planes[k];
+            if (!p) continue;
+            float gl = in.gain[k][0] * in.scale;
+            float gr = in.gain[k][1] * in.scale;
+            for (uint32_t i = 0; i < n; ++i) {
+                left[i]  += p[i] * gl;
+                right[i] += p[i] * gr;
+            }
+        }
+    }
+
+    void interleave(float* __restrict out, uint32_t n) const {
+        for (uint32_t i = 0; i < n; ++i) {
+            out[i * 2 + 0] = m_left[i];
+            out[i * 2 + 1] = m_right[i];
+        }
+    }
+
+    Input                m_inputs[INPUT_COUNT];
+    std::vector<Setting> m_settings;
+    float                m_left[BLOCK];
+    float                m_right[BLOCK];
+    uint32_t             m_seed = 0;
+};
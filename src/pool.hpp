@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// A pool of worker threads for repeating tasks with deadlines. Every worker
+// has its own queue ordered by deadline; it runs the earliest task of its own
+// queue once that task is ready, and steals the earliest ready task of
+// another worker when it has nothing to do. A task that returns true goes
+// back into the queue of the worker that ran it, with its new times.
+//
+// Queues are ordered by deadline only, so a task must not become ready
+// later than a task with a later deadline.
+class DeadlinePool {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Task {
+        Clock::time_point ready;
+        Clock::time_point deadline;
+        int               id;
+    };
+    using Run = std::function<bool(Task&)>;
+
+    DeadlinePool(int threads, Run run) : m_run(run), m_start(Clock::now()) {
+        for (int i = 0; i < threads; ++i) m_workers.emplace_back(new Worker);
+        for (int i = 0; i < threads; ++i) m_workers[i]->thread = std::thread([this, i]{ work(i); });
+    }
+
+    ~DeadlinePool() {
+        {
+            std::lock_guard<std::mutex> lock(m_idle_mutex);
+            m_quit = true;
+        }
+        m_idle_cond.notify_all();
+        for (auto& w : m_workers) w->thread.join();
+    }
+
+    void submit(Task const& task) {
+        ++m_pending;
+        push(m_next_worker++ % m_workers.size(), task);
+    }
+
+    bool idle() const { return m_pending == 0; }
+
+    // wait until no task is left
+    void wait() {
+        std::unique_lock<std::mutex> lock(m_idle_mutex);
+        m_idle_cond.wait(lock, [this]{ return m_pending == 0; });
+    }
+
+    // fraction of the time the workers were busy since the last call
+    float utilization() {
+        Clock::time_point now = Clock::now();
+        int64_t busy = 0;
+        for (auto& w : m_workers) busy += w->busy.exchange(0);
+        float wall = std::chrono::duration<float, std::nano>(now - m_start).count() * m_workers.size();
+        m_start = now;
+        return wall > 0 ? busy / wall : 0;
+    }
+
+    uint64_t steals() const { return m_steals; }
+
+private:
+    struct Later {
+        bool operator()(Task const& a, Task const& b) const { return a.deadline > b.deadline; }
+    };
+    struct Worker {
+        std::mutex           mutex;
+        std::vector<Task>    heap;
+        std::atomic<int64_t> busy{0}; // ns
+        std::thread          thread;
+    };
+
+    void push(size_t w, Task const& task) {
+        {
+            Worker& worker = *m_workers[w];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.heap.push_back(task);
+            std::push_heap(worker.heap.begin(), worker.heap.end(), Later());
+        }
+        std::lock_guard<std::mutex> lock(m_idle_mutex);
+        ++m_epoch;
+        m_idle_cond.notify_all();
+    }
+
+    // pop the top of a queue if it is ready, otherwise report when it will be
+    bool pop(Worker& worker, Clock::time_point now, Task& task, Clock::time_point& next) {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.heap.empty()) return false;
+        if (worker.heap.front().ready > now) {
+            next = std::min(next, worker.heap.front().ready);
+            return false;
+        }
+        std::pop_heap(worker.heap.begin(), worker.heap.end(), Later());
+        task = worker.heap.back();
+        worker.heap.pop_back();
+        return true;
+    }
+
+    bool steal(size_t self, Clock::time_point now, Task& task, Clock::time_point& next) {
+        // pick the victim whose top task has the earliest deadline
+        size_t            victim = self;
+        Clock::time_point best   = Clock::time_point::max();
+        for (size_t i = 0; i < m_workers.size(); ++i) {
+            if (i == self) continue;
+            Worker& w = *m_workers[i];
+            std::lock_guard<std::mutex> lock(w.mutex);
+            if (w.heap.empty()) continue;
+            if (w.heap.front().ready > now) {
+                next = std::min(next, w.heap.front().ready);
+                continue;
+            }
+            if (w.heap.front().deadline < best) {
+                best   = w.heap.front().deadline;
+                victim = i;
+            }
+        }
+        if (victim == self || !pop(*m_workers[victim], now, task, next)) return false;
+        ++m_steals;
+        return true;
+    }
+
+    void work(size_t self) {
+        Worker& worker = *m_workers[self];
+        for (;;) {
+            uint64_t epoch;
+            {
+                std::lock_guard<std::mutex> lock(m_idle_mutex);
+                epoch = m_epoch;
+            }
+            Clock::time_point now  = Clock::now();
+            Clock::time_point next = Clock::time_point::max();
+            Task task;
+            if (pop(worker, now, task, next) || steal(self, now, task, next)) {
+                bool again = m_run(task);
+                worker.busy += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - now).count();
+                if (again) {
+                    push(self, task);
+                }
+                else if (--m_pending == 0) {
+                    std::lock_guard<std::mutex> lock(m_idle_mutex);
+                    m_idle_cond.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_idle_mutex);
+            if (m_quit) break;
+            // something was pushed while we were looking
+            if (m_epoch != epoch) continue;
+            if (next == Clock::time_point::max()) m_idle_cond.wait(lock);
+            else                                  m_idle_cond.wait_until(lock, next);
+        }
+    }
+
+    Run                                  m_run;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<size_t>                  m_next_worker{0};
+    std::atomic<int>                     m_pending{0};
+    std::atomic<uint64_t>                m_steals{0};
+    Clock::time_point                    m_start;
+    bool                                 m_quit  = false;
+    uint64_t                             m_epoch = 0;
+    std::mutex                           m_idle_mutex;
+    std::condition_variable              m_idle_cond;
+};
@@ -0,0 +1,238 @@
+// Extracts the register writes of each chip of a VGM into RegLog files, and
+// replays such a log on the chip alone as fast as possible. This is meant for
+// profiling and comparing changes to a single chip core on real songs.
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <type_traits>
+#include <unistd.h>
+
+#include "vgm.hpp"
+
+
+// the native sample timebase of a chip, as used by VGM. the ym2203 depends on the fidelity
+static Timebase native_timebase(int chip, uint32_t clock) {
+    ymfm::ymfm_interface iface;
+    Timebase             time;
+    switch (chip) {
+    case Mixer::YM2612:        time.set_rate(clock, ymfm::ym3438(iface).sample_rate(clock)); break;
+    case Mixer::YM2151:        time.set_rate(clock, ymfm::ym2151(iface).sample_rate(clock)); break;
+    case Mixer::YM2203_SIMPLE: time.set(MIXRATE); break;
+    case Mixer::RF5C68:        time.set(clock, RF5C68::CLOCK_DIVIDER); break;
+    case Mixer::GA20:          time.set(clock, GA20::CLOCK_DIVIDER); break;
+    case Mixer::LR35902:       time.set(clock, LR35902::CLOCK_DIVIDER); break;
+    default: break;
+    }
+    return time;
+}
+
+// the output is summed up, so the compiler can't drop the work and two builds
+// can be checked for identical output
+template<class Chip>
+struct IntDevice {
+    Chip     chip;
+    Timebase time;
+    int64_t  sum   = 0;
+    uint64_t count = 0;
+    IntDevice(Timebase time) : time(time) { chip.reset(); }
+    void wait(uint64_t n) {
+        for (uint64_t s = time.advance(n); s > 0; --s) {
+            int out[2];
+            chip.generate(out);
+            sum += out[0] + out[1];
+        }
+        count += n;
+    }
+    void write(bool hi, uint8_t a, uint8_t v) { chip.write_reg(a, v); }
+    void write_mem(uint32_t addr, uint8_t const* data, uint32_t n) {
+        for (uint32_t i = 0; i < n; ++i) chip.write_mem(addr + i, data[i]);
+    }
+};
+
+// LR35902 has no memory
+template<>
+void IntDevice<LR35902>::write_mem(uint32_t addr, uint8_t const* data, uint32_t n) {}
+
+template<class Chip, int N>
+struct YmfmDevice {
+    ymfm::ymfm_interface iface;
+    Chip                 chip{iface};
+    Timebase             time;
+    int64_t              sum   = 0;
+    uint64_t             count = 0;
+    YmfmDevice(Timebase time) : time(time) { chip.reset(); }
+    void wait(uint64_t n) {
+        for (uint64_t s = time.advance(n); s > 0; --s) {
+            ymfm::ymfm_output<N> out;
+            chip.generate(&out);
+            for (int k = 0; k < N; ++k) sum += out.data[k];
+        }
+        count += n;
+    }
+    void write(bool hi, uint8_t a, uint8_t v) {
+        // only the ym2612 has a second port
+        if constexpr (std::is_same<Chip, ymfm::ym3438>::value) {
+            if (hi) {
+                chip.write_address_hi(a);
+                chip.write_data_hi(v);
+                return;
+            }
+        }
+        chip.write_address(a);
+        chip.write_data(v);
+    }
+    void write_mem(uint32_t addr, uint8_t const* data, uint32_t n) {}
+};
+
+// the simple YM2203 renders at MIXRATE directly
+struct SimpleDevice {
+    YM2203   chip;
+    double   sum   = 0;
+    uint64_t count = 0;
+    SimpleDevice(uint32_t clock) { chip.set_clock(clock); }
+    void wait(uint64_t n) {
+        for (uint64_t s = 0; s < n; ++s) {
+            float out[2] = {};
+            chip.render(out);
+            sum += out[0] + out[1];
+        }
+        count += n;
+    }
+    void write(bool hi, uint8_t a, uint8_t v) { chip.write_reg(a, v); }
+    void write_mem(uint32_t addr, uint8_t const* data, uint32_t n) {}
+};
+
+
+template<class Device>
+static bool replay(RegLog const& log, Device& dev, int repeat) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; ++i) {
+        if (!log.replay(dev)) {
+            log_queue.drain();
+            printf("error: corrupt log\n");
+            return false;
+        }
+    }
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+    log_queue.drain();
+    double song = dev.count / double(MIXRATE);
+    printf("%s: %.2f s of audio in %.3f s, %.1fx real time, checksum %.17g\n",
+           Mixer::input_name(log.chip), song, time.count(), song / time.count(), double(dev.sum));
+    return true;
+}
+
+static bool extract(char const* filename, char const* prefix) {
+    std::unique_ptr<VGM> vgm(new VGM);
+    if (!vgm->init(filename, 1)) {
+        printf("error: %s\n", vgm->error());
+        return false;
+    }
+    VGM::Info const& info = vgm->info();
+    uint32_t const clocks[Mixer::INPUT_COUNT] = {
+        info.ym2612_clock, info.ym2151_clock, info.ym2203_clock, 0,
+        info.rf5c68_clock, info.ga20_clock, info.lr35902_clock,
+    };
+    RegLog logs[Mixer::INPUT_COUNT];
+    vgm->record(logs);
+    vgm->scan();
+    vgm->log().drain();
+    for (int i = 0; i < Mixer::INPUT_COUNT; ++i) {
+        RegLog& log = logs[i];
+        if (!clocks[i] || log.empty()) continue;
+        log.chip  = i;
+        log.clock = clocks[i];
+        std::string path = std::string(prefix) + "-" + Mixer::input_name(i) + ".reglog";
+        if (!log.save(path.c_str())) {
+            printf("error: couldn't write %s\n", path.c_str());
+            return false;
+        }
+        printf("%s: %zu bytes, %.2f s\n", path.c_str(), log.size(), log.samples() / double(MIXRATE));
+    }
+    return true;
+}
+
+
+int main(int argc, char** argv) {
+    char const* prefix  = nullptr;
+    int         repeat  = 1;
+    bool        simple  = false;
+    int         quality = 1;
+    bool        usage   = false;
+    int         opt;
+    while ((opt = getopt(argc, argv, "x:n:sq:")) != -1) {
+        switch (opt) {
+        case 'x': prefix = optarg; break;
+        case 'n': repeat = std::max(1, atoi(optarg)); break;
+        case 's': simple = true; break;
+        case 'q': quality = atoi(optarg); break;
+        default: usage = true; break;
+        }
+    }
+    if (argc - optind != 1 || usage) {
+        printf("Usage: %s -x prefix vgm-file\n"
+               "       %s [-n repeat] [-s] [-q quality] reglog-file\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (prefix) return extract(argv[optind], prefix) ? 0 : 1;
+
+    RegLog log;
+    if (!log.load(argv[optind])) {
+        printf("error: couldn't read %s\n", argv[optind]);
+        return 1;
+    }
+    if (simple && log.chip == Mixer::YM2203) log.chip = Mixer::YM2203_SIMPLE;
+    Timebase time = native_timebase(log.chip, log.clock);
+    bool     ok   = true;
+    switch (log.chip) {
+    case Mixer::YM2612: {
+        YmfmDevice<ymfm::ym3438, 2> dev(time);
+        ok = replay(log, dev, repeat);
+        break;
+    }
+    case Mixer::YM2151: {
+        YmfmDevice<ymfm::ym2151, 2> dev(time);
+        ok = replay(log, dev, repeat);
+        break;
+    }
+    case Mixer::YM2203: {
+        // same fidelities as VGM::set_quality
+        static const ymfm::opn_fidelity FIDELITY[] = {
+            ymfm::OPN_FIDELITY_MIN,
+            ymfm::OPN_FIDELITY_MIN,
+            ymfm::OPN_FIDELITY_MED,
+            ymfm::OPN_FIDELITY_MAX,
+        };
+        YmfmDevice<ymfm::ym2203, 4> dev(time);
+        dev.chip.set_fidelity(FIDELITY[std::min(std::max(quality, 0), VGM::QUALITY_LEVELS - 1)]);
+        dev.time.set_rate(log.clock, dev.chip.sample_rate(log.clock));
+        ok = replay(log, dev, repeat);
+        break;
+    }
+    case Mixer::YM2203_SIMPLE: {
+        SimpleDevice dev(log.clock);
+        ok = replay(log, dev, repeat);
+        break;
+    }
+    case Mixer::RF5C68: {
+        IntDevice<RF5C68> dev(time);
+        ok = replay(log, dev, repeat);
+        break;
+    }
+    case Mixer::GA20: {
+        IntDevice<GA20> dev(time);
+        ok = replay(log, dev, repeat);
+        break;
+    }
+    case Mixer::LR35902: {
+        IntDevice<LR35902> dev(time);
+        ok = replay(log, dev, repeat);
+        break;
+    }
+    default:
+        printf("error: unknown chip %d\n", log.chip);
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+
+// The timed register writes and data blocks of one chip, in a compact binary
+// form for replaying the chip on its own. The file starts with "VGRL", a
+// version byte, the chip (a Mixer input) and its clock, followed by ops:
+//
+//   WAIT     n     wait n samples at MIXRATE (varint)
+//   WRITE    a v   write value v to register a
+//   WRITE_HI a v   the same for the second port of the YM2612
+//   BLOCK    a n   write n bytes of data to memory address a (varints), followed by the data
+class RegLog {
+public:
+    enum { VERSION = 1 };
+    enum Op : uint8_t { WAIT, WRITE, WRITE_HI, BLOCK };
+
+    int      chip  = 0;
+    uint32_t clock = 0;
+
+    bool empty() const { return m_ops.empty(); }
+    size_t size() const { return m_ops.size(); }
+    uint64_t samples() const { return m_time; }
+
+    void write(uint64_t time, Op op, uint8_t a, uint8_t v) {
+        wait(time);
+        m_ops.push_back(op);
+        m_ops.push_back(a);
+        m_ops.push_back(v);
+    }
+    void block(uint64_t time, uint32_t addr, uint8_t const* data, uint32_t n) {
+        wait(time);
+        m_ops.push_back(BLOCK);
+        put(addr);
+        put(n);
+        m_ops.insert(m_ops.end(), data, data + n);
+    }
+    // the end of the song, so that trailing waits are replayed too
+    void finish(uint64_t time) { wait(time); }
+
+    bool save(char const* path) const {
+        FILE* file = fopen(path, "wb");
+        if (!file) return false;
+        uint8_t header[10] = { 'V', 'G', 'R', 'L', VERSION, uint8_t(chip) };
+        memcpy(header + 6, &clock, 4);
+        bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+        ok &= fwrite(m_ops.data(), 1, m_ops.size(), file) == m_ops.size();
+        ok &= fclose(file) == 0;
+        return ok;
+    }
+    bool load(char const* path) {
+        FILE* file = fopen(path, "rb");
+        if (!file) return false;
+        uint8_t header[10];
+        bool ok = fread(header, 1, sizeof(header), file) == sizeof(header)
+               && memcmp(header, "VGRL", 4) == 0 && header[4] == VERSION;
+        if (ok) {
+            chip = header[5];
+            memcpy(&clock, header + 6, 4);
+            m_ops.clear();
+            uint8_t buf[1 << 12];
+            for (size_t n; (n = fread(buf, 1, sizeof(buf), file)) > 0;) m_ops.insert(m_ops.end(), buf, buf + n);
+        }
+        fclose(file);
+        return ok;
+    }
+
+    // call dev.wait(n), dev.write(port, a, v) and dev.write_mem(addr, data, n) for each op.
+    // returns false if the log is truncated or corrupt, after replaying the valid part
+    template<class Device>
+    bool replay(Device& dev) const {
+        uint8_t const* p   = m_ops.data();
+        uint8_t const* end = p + m_ops.size();
+        while (p < end) {
+            uint64_t x, addr, n;
+            switch (*p++) {
+            case WAIT:
+                if (!get(p, end, x)) return false;
+                dev.wait(x);
+                break;
+            case WRITE:
+            case WRITE_HI:
+                if (end - p < 2) return false;
+                dev.write(p[-1] == WRITE_HI, p[0], p[1]);
+                p += 2;
+                break;
+            case BLOCK:
+                if (!get(p, end, addr) || !get(p, end, n) || n > uint64_t(end - p) || addr > UINT32_MAX) return false;
+                dev.write_mem(uint32_t(addr), p, uint32_t(n));
+                p += n;
+                break;
+            default: return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    void wait(uint64_t time) {
+        if (time <= m_time) return;
+        m_ops.push_back(WAIT);
+        put(time - m_time);
+        m_time = time;
+    }
+    void put(uint64_t x) {
+        for (; x >= 0x80; x >>= 7) m_ops.push_back(0x80 | (x & 0x7f));
+        m_ops.push_back(x);
+    }
+    static bool get(uint8_t const*& p, uint8_t const* end, uint64_t& x) {
+        x = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            uint8_t b = *p++;
+            x |= uint64_t(b & 0x7f) << shift;
+            if (b < 0x80) return true;
+        }
+        return false;
+    }
+
+    std::vector<uint8_t> m_ops;
+    uint64_t             m_time = 0;
+};
@@ -2,10 +2,21 @@
 
 #include <cstdint>
 #include <array>
+#include <algorithm>
 
 
 class RF5C68 {
 public:
+    // one sample every CLOCK_DIVIDER clock cycles
+    enum { CHANNELS = 8, CLOCK_DIVIDER = 384 };
+
+    void reset() {
+        m_channels = {};
+        m_cbank    = 0;
+        m_wbank    = 0;
+        m_enable   = false;
+        m_data.fill(0);
+    }
     void write_mem(uint16_t addr, uint8_t data) {
         m_data[addr] = data;
     }
@@ -47,11 +58,14 @@ public:
             break;
         }
     }
-    void generate(int* out) {
+    // chan_out, if given, receives the stereo output of each channel
+    void generate(int* out, int* chan_out = nullptr) {
         out[0] = 0;
         out[1] = 0;
+        if (chan_out) std::fill(chan_out, chan_out + CHANNELS * 2, 0);
         if (!m_enable) return;
-        for (Channel& chan : m_channels) {
+        for (std::size_t i = 0; i < m_channels.size(); i++) {
+            Channel& chan = m_channels[i];
             if (!chan.enabled) continue;
 
             int sample = m_data[(chan.addr >> 11) & 0xffff];
@@ -64,14 +78,21 @@ public:
 
             int lv = (chan.pan & 0xf) * chan.vol;
             int rv = (chan.pan >>  4) * chan.vol;
+            int l, r;
             if (sample & 0x80) {
                 sample &= 0x7f;
-                out[0] += (sample * lv) >> 5;
-                out[1] += (sample * rv) >> 5;
+                l = (sample * lv) >> 5;
+                r = (sample * rv) >> 5;
             }
             else {
-                out[0] -= (sample * lv) >> 5;
-                out[1] -= (sample * rv) >> 5;
+                l = -((sample * lv) >> 5);
+                r = -((sample * rv) >> 5);
+            }
+            out[0] += l;
+            out[1] += r;
+            if (chan_out) {
+                chan_out[i * 2 + 0] = l;
+                chan_out[i * 2 + 1] = r;
             }
         }
     }
@@ -0,0 +1,233 @@
+// Renders many VGM streams at once in real time. Every stream is rendered
+// in fixed-size blocks on a DeadlinePool, where a block's deadline is the
+// time its listener would run out of audio, and the output goes to a local
+// sink: a file, a FIFO, or a Unix socket given as unix:/path.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vgm.hpp"
+#include "pool.hpp"
+
+
+using Clock = DeadlinePool::Clock;
+
+struct Session {
+    std::string          name;
+    VGM                  vgm;
+    int                  fd = -1;
+    std::vector<uint8_t> pending; // output the sink hasn't taken yet
+    std::vector<float>   fbuf;
+    std::vector<int16_t> ibuf;
+    uint64_t             frames = 0;
+    Clock::time_point    start;
+
+    // stats, read by the main thread
+    std::atomic<int64_t>  deadline_us{0}; // of the next block, relative to start
+    std::atomic<int64_t>  max_late_us{0};
+    std::atomic<uint32_t> late_blocks{0};
+    std::atomic<uint64_t> dropped_bytes{0};
+    std::atomic<bool>     done{false};
+};
+
+struct Config {
+    uint32_t block     = 1024;
+    int      buffer_ms = 200;
+    bool     int16     = false;
+};
+
+
+static int open_sink(char const* spec) {
+    if (strncmp(spec, "unix:", 5) == 0) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, spec + 5, sizeof(addr.sun_path) - 1);
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    // this blocks until a FIFO has a reader
+    return open(spec, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+// write as much as the sink takes without blocking. returns false if the sink is gone
+static bool flush(Session& s) {
+    size_t written = 0;
+    while (written < s.pending.size()) {
+        ssize_t n = write(s.fd, s.pending.data() + written, s.pending.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        written += n;
+    }
+    s.pending.erase(s.pending.begin(), s.pending.begin() + written);
+    return true;
+}
+
+static void finish(Session& s) {
+    // hand over the rest, blocking this time
+    fcntl(s.fd, F_SETFL, fcntl(s.fd, F_GETFL) & ~O_NONBLOCK);
+    flush(s);
+    close(s.fd);
+    s.done = true;
+}
+
+static bool render(Session& s, Config const& config, DeadlinePool::Task& task) {
+    uint32_t       n;
+    uint8_t const* data;
+    size_t         bytes;
+    if (config.int16) {
+        n     = s.vgm.render(s.ibuf.data(), config.block);
+        data  = (uint8_t const*)s.ibuf.data();
+        bytes = n * 2 * sizeof(int16_t);
+    }
+    else {
+        n     = s.vgm.render(s.fbuf.data(), config.block);
+        data  = (uint8_t const*)s.fbuf.data();
+        bytes = n * 2 * sizeof(float);
+    }
+    s.pending.insert(s.pending.end(), data, data + bytes);
+    if (!flush(s)) {
+        log_message("stream %d: sink closed\n", task.id);
+        close(s.fd);
+        s.done = true;
+        return false;
+    }
+    // a listener that doesn't keep up loses audio rather than holding up a worker
+    size_t max_pending = MIXRATE * 2 * (config.int16 ? sizeof(int16_t) : sizeof(float));
+    if (s.pending.size() > max_pending) {
+        s.dropped_bytes += s.pending.size();
+        s.pending.clear();
+    }
+
+    Clock::time_point now = Clock::now();
+    if (now > task.deadline) {
+        int64_t late = std::chrono::duration_cast<std::chrono::microseconds>(now - task.deadline).count();
+        ++s.late_blocks;
+        if (late > s.max_late_us) s.max_late_us = late;
+    }
+    if (s.vgm.done()) {
+        finish(s);
+        return false;
+    }
+
+    s.frames += n;
+    auto deadline = std::chrono::microseconds(s.frames * 1000000 / MIXRATE);
+    s.deadline_us = deadline.count();
+    task.deadline = s.start + deadline;
+    task.ready    = task.deadline - std::chrono::milliseconds(config.buffer_ms);
+    return true;
+}
+
+
+int main(int argc, char** argv) {
+    Config config;
+    int    threads    = std::max(1u, std::thread::hardware_concurrency());
+    int    loop_count = 0;
+    int    quality    = 1;
+    int    stats      = 1;
+    bool   usage      = false;
+    int    opt;
+    while ((opt = getopt(argc, argv, "j:b:B:iq:l:s:")) != -1) {
+        switch (opt) {
+        case 'j': threads = std::max(1, atoi(optarg)); break;
+        case 'b': config.block = std::max(1, atoi(optarg)); break;
+        case 'B': config.buffer_ms = std::max(0, atoi(optarg)); break;
+        case 'i': config.int16 = true; break;
+        case 'q': quality = std::min(std::max(atoi(optarg), 0), VGM::QUALITY_LEVELS - 1); break;
+        case 'l': loop_count = atoi(optarg); break;
+        case 's': stats = atoi(optarg); break;
+        default: usage = true; break;
+        }
+    }
+    if (argc - optind < 1 || usage) {
+        printf("Usage: %s [-j threads] [-b block_frames] [-B buffer_ms] [-i] [-q quality] [-l loop_count]"
+               " [-s stats_seconds] vgm-file=sink...\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::unique_ptr<Session>> sessions;
+    for (int i = optind; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t      eq  = arg.rfind('=');
+        if (eq == std::string::npos) {
+            printf("error: expected vgm-file=sink, got %s\n", argv[i]);
+            return 1;
+        }
+        sessions.emplace_back(new Session);
+        Session& s = *sessions.back();
+        s.name = arg.substr(0, eq);
+        s.vgm.set_quality(quality);
+        if (!s.vgm.init(s.name.c_str(), loop_count)) {
+            printf("error: %s: %s\n", s.name.c_str(), s.vgm.error());
+            return 1;
+        }
+        s.fd = open_sink(arg.c_str() + eq + 1);
+        if (s.fd < 0) {
+            printf("error: couldn't open sink %s\n", arg.c_str() + eq + 1);
+            return 1;
+        }
+        fcntl(s.fd, F_SETFL, fcntl(s.fd, F_GETFL) | O_NONBLOCK);
+        s.fbuf.resize(config.int16 ? 0 : config.block * 2);
+        s.ibuf.resize(config.int16 ? config.block * 2 : 0);
+    }
+
+    DeadlinePool pool(threads, [&](DeadlinePool::Task& task) {
+        return render(*sessions[task.id], config, task);
+    });
+    // the first deadline is one buffer away, so every stream can fill its buffer first
+    Clock::time_point start = Clock::now() + std::chrono::milliseconds(config.buffer_ms);
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        sessions[i]->start = start;
+        pool.submit({ start - std::chrono::milliseconds(config.buffer_ms), start, int(i) });
+    }
+
+    // each song has its own queue, so a song that warns a lot can't crowd out the others
+    auto drain_logs = [&] {
+        log_queue.drain();
+        for (auto& s : sessions) s->vgm.log().drain(stdout, s->name.c_str());
+    };
+    Clock::time_point next_stats = Clock::now() + std::chrono::seconds(stats);
+    while (!pool.idle()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        drain_logs();
+        if (stats <= 0 || Clock::now() < next_stats) continue;
+        next_stats += std::chrono::seconds(stats);
+
+        int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+        printf("pool: %.0f%% busy, %d threads, %llu steals\n",
+               pool.utilization() * 100, threads, (unsigned long long)pool.steals());
+        for (size_t i = 0; i < sessions.size(); ++i) {
+            Session& s = *sessions[i];
+            if (s.done) continue;
+            // lag is how far the stream is behind its listener
+            int64_t ahead = s.deadline_us - now_us;
+            printf("  %zu: ahead %lld ms, lag %lld ms, late blocks %u (max %lld ms), dropped %llu bytes\n", i,
+                   (long long)std::max<int64_t>(ahead, 0) / 1000, (long long)std::max<int64_t>(-ahead, 0) / 1000,
+                   s.late_blocks.load(), (long long)s.max_late_us / 1000, (unsigned long long)s.dropped_bytes);
+        }
+        fflush(stdout);
+    }
+    pool.wait();
+    drain_logs();
+    return 0;
+}
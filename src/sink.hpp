@@ -0,0 +1,184 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <sndfile.h>
+
+#include "mixer.hpp"
+
+
+enum class SampleFormat { FLOAT, INT16 };
+
+class Sink {
+public:
+    virtual ~Sink() {}
+    virtual bool write(float const* buffer, uint32_t frames) = 0;
+};
+
+// raw interleaved stereo PCM, e.g. to stdout for piping into an encoder
+class RawSink : public Sink {
+public:
+    RawSink(FILE* file, SampleFormat format) : m_file(file), m_format(format) {}
+    ~RawSink() override { fflush(m_file); }
+    bool write(float const* buffer, uint32_t frames) override {
+        uint32_t n = frames * 2;
+        if (m_format == SampleFormat::FLOAT) return fwrite(buffer, sizeof(float), n, m_file) == n;
+        m_tmp.resize(n);
+        convert_int16(buffer, m_tmp.data(), n, m_seed);
+        return fwrite(m_tmp.data(), sizeof(int16_t), n, m_file) == n;
+    }
+private:
+    FILE*                m_file;
+    SampleFormat         m_format;
+    uint32_t             m_seed = 0;
+    std::vector<int16_t> m_tmp;
+};
+
+// WAV or FLAC via libsndfile. FLAC has no float format, so it is always int16
+class SndfileSink : public Sink {
+public:
+    bool open(char const* path, int rate, SampleFormat format) {
+        char const* ext = strrchr(path, '.');
+        bool flac = ext && strcasecmp(ext, ".flac") == 0;
+        m_format = flac ? SampleFormat::INT16 : format;
+        SF_INFO info = {};
+        info.samplerate = rate;
+        info.channels   = 2;
+        info.format     = (flac ? SF_FORMAT_FLAC : SF_FORMAT_WAV)
+                        | (m_format == SampleFormat::FLOAT ? SF_FORMAT_FLOAT : SF_FORMAT_PCM_16);
+        m_file = sf_open(path, SFM_WRITE, &info);
+        if (!m_file) {
+            printf("error: couldn't open %s: %s\n", path, sf_strerror(nullptr));
+            return false;
+        }
+        return true;
+    }
+    ~SndfileSink() override {
+        if (m_file) sf_close(m_file);
+    }
+    bool write(float const* buffer, uint32_t frames) override {
+        if (m_format == SampleFormat::FLOAT) return sf_writef_float(m_file, buffer, frames) == sf_count_t(frames);
+        m_tmp.resize(frames * 2);
+        convert_int16(buffer, m_tmp.data(), frames * 2, m_seed);
+        return sf_writef_short(m_file, m_tmp.data(), frames) == sf_count_t(frames);
+    }
+private:
+    SNDFILE*             m_file   = nullptr;
+    SampleFormat         m_format = SampleFormat::FLOAT;
+    uint32_t             m_seed   = 0;
+    std::vector<int16_t> m_tmp;
+};
+
+
+// double-buffered writer thread. the caller renders into buffer() and
+// hands it over with submit(), which only blocks if the sink is still
+// busy with the previous buffer
+class AsyncWriter {
+public:
+    AsyncWriter(Sink& sink, uint32_t frames) : m_sink(sink) {
+        m_buffers[0].resize(frames * 2);
+        m_buffers[1].resize(frames * 2);
+        m_thread = std::thread([this]{ run(); });
+    }
+    ~AsyncWriter() { finish(); }
+
+    float* buffer() { return m_buffers[m_back].data(); }
+
+    void submit(uint32_t frames) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]{ return !m_pending; });
+        m_frames  = frames;
+        m_pending = true;
+        m_back ^= 1;
+        m_cond.notify_all();
+    }
+
+    // wait for all pending data and stop the thread
+    bool finish() {
+        if (m_thread.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cond.wait(lock, [this]{ return !m_pending; });
+                m_quit = true;
+                m_cond.notify_all();
+            }
+            m_thread.join();
+        }
+        return m_ok;
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            m_cond.wait(lock, [this]{ return m_pending || m_quit; });
+            if (!m_pending) break;
+            float const* buffer = m_buffers[m_back ^ 1].data();
+            lock.unlock();
+            bool ok = m_sink.write(buffer, m_frames);
+            lock.lock();
+            if (!ok) m_ok = false;
+            m_pending = false;
+            m_cond.notify_all();
+        }
+    }
+
+    Sink&                   m_sink;
+    std::vector<float>      m_buffers[2];
+    int                     m_back    = 0;
+    uint32_t                m_frames  = 0;
+    bool                    m_pending = false;
+    bool                    m_quit    = false;
+    bool                    m_ok      = true;
+    std::mutex              m_mutex;
+    std::condition_variable m_cond;
+    std::thread             m_thread;
+};
+
+// A ring of interleaved stereo frames with a single writer and a single reader,
+// so that the audio callback can hand its output to a normal thread without
+// locks or allocations. The size must be a power of two
+class FrameRing {
+public:
+    explicit FrameRing(uint32_t frames) : m_buffer(frames * 2), m_mask(frames - 1) {}
+
+    // returns false and writes nothing if there isn't room for all frames
+    bool push(float const* data, uint32_t frames) {
+        uint64_t w = m_write.load(std::memory_order_relaxed);
+        if (w + frames - m_read.load(std::memory_order_acquire) > m_mask + 1) return false;
+        for (uint32_t i = 0; i < frames; ++i) {
+            uint64_t k = (w + i) & m_mask;
+            m_buffer[k * 2 + 0] = data[i * 2 + 0];
+            m_buffer[k * 2 + 1] = data[i * 2 + 1];
+        }
+        m_write.store(w + frames, std::memory_order_release);
+        return true;
+    }
+
+    // returns the number of frames read
+    uint32_t pop(float* data, uint32_t frames) {
+        uint64_t r = m_read.load(std::memory_order_relaxed);
+        uint32_t n = std::min<uint64_t>(frames, m_write.load(std::memory_order_acquire) - r);
+        for (uint32_t i = 0; i < n; ++i) {
+            uint64_t k = (r + i) & m_mask;
+            data[i * 2 + 0] = m_buffer[k * 2 + 0];
+            data[i * 2 + 1] = m_buffer[k * 2 + 1];
+        }
+        m_read.store(r + n, std::memory_order_release);
+        return n;
+    }
+
+private:
+    std::vector<float>    m_buffer;
+    uint64_t              m_mask;
+    std::atomic<uint64_t> m_write{0};
+    std::atomic<uint64_t> m_read{0};
+};
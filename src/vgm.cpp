@@ -0,0 +1,940 @@
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <new>
+#include <zlib.h>
+
+#include "vgm.hpp"
+#include "analyze.hpp"
+
+
+#pragma pack(push, 1)
+struct VGMHeader {
+    uint32_t magic;
+    uint32_t eof_offset;
+    uint32_t version;
+    uint32_t sn76489_clock;
+    uint32_t ym2413_clock;
+    uint32_t gd3_offset;
+    uint32_t total_samples;
+    uint32_t loop_offset;
+    uint32_t loop_samples;
+    uint32_t rate;
+    uint16_t sn76489_feedback;
+    uint8_t  sn76489_shift;
+    uint8_t  sn76489_flags;
+    uint32_t ym2612_clock;
+    uint32_t ym2151_clock;
+    uint32_t data_offset;
+    uint32_t _dummy_30[2];
+    uint32_t rf5c68_clock;
+    uint32_t ym2203_clock;
+    uint32_t ym2608_clock;
+    uint32_t YM2610_clock;
+    uint32_t _dummy_50[4];
+    uint32_t _dummy_60[4];
+    uint32_t _dummy_70[3];
+    uint8_t  volume_mod;
+    uint8_t  _dummy_7d;
+    uint8_t  loop_base;
+    uint8_t  loop_mod;
+    uint32_t lr35902_clock;
+    uint32_t _dummy_81[3];
+    uint32_t _dummy_90[4];
+    uint32_t _dummy_a0[4];
+    uint32_t _dummy_b0[4];
+    uint32_t _dummy_c0[4];
+    uint32_t _dummy_d0[4];
+    uint32_t ga20_clock;
+    uint32_t _dummy_e4[3];
+    uint32_t _dummy_f0[4];
+};
+#pragma pack(pop)
+
+
+// let zlib allocate from the player's memory resource. zfree doesn't get the size,
+// so it is stored in front of each allocation
+static constexpr size_t ZALLOC_HEADER = alignof(std::max_align_t);
+
+static void* zalloc(void* opaque, uInt items, uInt size) {
+    auto*  resource = static_cast<std::pmr::memory_resource*>(opaque);
+    size_t n        = size_t(items) * size + ZALLOC_HEADER;
+    try {
+        void* p = resource->allocate(n, ZALLOC_HEADER);
+        *static_cast<size_t*>(p) = n;
+        return static_cast<uint8_t*>(p) + ZALLOC_HEADER;
+    }
+    catch (std::bad_alloc const&) {
+        return Z_NULL;
+    }
+}
+
+static void zfree(void* opaque, void* address) {
+    auto* resource = static_cast<std::pmr::memory_resource*>(opaque);
+    void* p        = static_cast<uint8_t*>(address) - ZALLOC_HEADER;
+    resource->deallocate(p, *static_cast<size_t*>(p), ZALLOC_HEADER);
+}
+
+static bool inflate_gzip(std::pmr::vector<uint8_t>& data) {
+    if (data.size() < 2 || data[0] != 0x1f || data[1] != 0x8b) return true;
+
+    constexpr size_t CHUNK = 1 << 10;
+    std::pmr::vector<uint8_t> compressed(data.get_allocator());
+    std::swap(data, compressed);
+
+    z_stream zs = {};
+    zs.zalloc = zalloc;
+    zs.zfree  = zfree;
+    zs.opaque = data.get_allocator().resource();
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) return false;
+    zs.next_in  = compressed.data();
+    zs.avail_in = compressed.size();
+
+    size_t pos = 0;
+    do {
+        data.resize(pos + CHUNK);
+        zs.next_out  = data.data() + pos;
+        zs.avail_out = CHUNK;
+        pos += CHUNK;
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            inflateEnd(&zs);
+            return false;
+        }
+    } while (zs.avail_out == 0);
+    data.resize(pos - zs.avail_out);
+    inflateEnd(&zs);
+    return true;
+}
+
+// read a zero-terminated UTF-16LE string and convert it to UTF-8
+static uint32_t read_utf16(uint8_t const* data, uint32_t pos, uint32_t end, std::pmr::string& str) {
+    while (pos + 2 <= end) {
+        uint32_t c = data[pos] | data[pos + 1] << 8;
+        pos += 2;
+        if (c == 0) break;
+        if (c >= 0xd800 && c < 0xdc00 && pos + 2 <= end) {
+            uint32_t lo = data[pos] | data[pos + 1] << 8;
+            if (lo >= 0xdc00 && lo < 0xe000) {
+                pos += 2;
+                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+            }
+        }
+        if (c < 0x80) {
+            str += char(c);
+        }
+        else if (c < 0x800) {
+            str += char(0xc0 | c >> 6);
+            str += char(0x80 | (c & 0x3f));
+        }
+        else if (c < 0x10000) {
+            str += char(0xe0 | c >> 12);
+            str += char(0x80 | ((c >> 6) & 0x3f));
+            str += char(0x80 | (c & 0x3f));
+        }
+        else {
+            str += char(0xf0 | c >> 18);
+            str += char(0x80 | ((c >> 12) & 0x3f));
+            str += char(0x80 | ((c >> 6) & 0x3f));
+            str += char(0x80 | (c & 0x3f));
+        }
+    }
+    return pos;
+}
+
+
+VGM::VGM(std::pmr::memory_resource* resource)
+    : m_info{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+              std::pmr::string(resource), std::pmr::string(resource), std::pmr::string(resource),
+              std::pmr::string(resource), std::pmr::string(resource) }
+    , m_data(resource)
+    , m_banks(resource)
+    , m_loop_buffer(resource)
+{
+    m_banks.reserve(0x40);
+    for (int i = 0; i < 0x40; ++i) m_banks.emplace_back(resource);
+    ym2203_simple.set_log(&m_log);
+}
+
+bool VGM::init(char const* filename, int loop_count) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        snprintf(m_error, sizeof(m_error), "couldn't open file");
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    m_data.resize(size > 0 ? size : 0);
+    bool ok = fread(m_data.data(), 1, m_data.size(), file) == m_data.size();
+    fclose(file);
+    if (size < 0 || !ok) {
+        snprintf(m_error, sizeof(m_error), "couldn't read file");
+        return false;
+    }
+    return parse(loop_count);
+}
+
+bool VGM::init(void const* data, size_t size, int loop_count) {
+    auto const* p = static_cast<uint8_t const*>(data);
+    m_data.assign(p, p + size);
+    return parse(loop_count);
+}
+
+bool VGM::parse(int loop_count) {
+    if (!inflate_gzip(m_data)) {
+        snprintf(m_error, sizeof(m_error), "couldn't inflate file");
+        return false;
+    }
+
+    // parse header
+    if (m_data.size() < sizeof(VGMHeader)) {
+        snprintf(m_error, sizeof(m_error), "file too small");
+        return false;
+    }
+    VGMHeader& header = *(VGMHeader*)m_data.data();
+    if (header.magic != 0x206d6756) { // "Vgm "
+        snprintf(m_error, sizeof(m_error), "wrong magic");
+        return false;
+    }
+    if (header.version < 0x151) {
+        snprintf(m_error, sizeof(m_error), "version %x too old", header.version);
+        return false;
+    }
+
+    m_loop_count = loop_count;
+    m_loop_pos   = header.loop_offset + 0x1c;
+    if (m_loop_pos == 0x1c || m_loop_pos >= m_data.size()) m_loop_pos = 0;
+    restart();
+
+    // GD3 tag: english and japanese track name, game, system and author, then date
+    uint32_t gd3 = header.gd3_offset + 0x14;
+    if (header.gd3_offset && gd3 + 12 <= m_data.size() && memcmp(&m_data[gd3], "Gd3 ", 4) == 0) {
+        uint32_t end = gd3 + 12 + (m_data[gd3 + 8] | m_data[gd3 + 9] << 8 | m_data[gd3 + 10] << 16 | m_data[gd3 + 11] << 24);
+        end = std::min<uint32_t>(end, m_data.size());
+        std::pmr::string* const FIELDS[] = {
+            &m_info.title, nullptr, &m_info.game, nullptr, &m_info.system, nullptr, &m_info.author, nullptr, &m_info.date,
+        };
+        std::pmr::string skip(m_data.get_allocator().resource());
+        uint32_t pos = gd3 + 12;
+        for (std::pmr::string* field : FIELDS) {
+            skip.clear();
+            pos = read_utf16(m_data.data(), pos, end, field ? *field : skip);
+        }
+    }
+
+    // volume mod
+    int v = header.volume_mod;
+    if (v > 192) v = v - 192 - 63;
+    if (v == -63) --v;
+    m_volume = exp2(v / 64.0);
+    m_info.version       = header.version;
+    m_info.total_samples = header.total_samples;
+    m_info.loop_samples  = header.loop_samples;
+    m_info.volume        = m_volume;
+    if (m_fade && m_loop_pos && loop_count > 1) {
+        m_fade_end = header.total_samples + uint64_t(loop_count - 1) * header.loop_samples;
+    }
+    m_volume *= 0.00005;
+
+    static const float STEREO[][2] = { { 1, 0 }, { 0, 1 } };
+    static const float YM2203_PAN[] = {
+        0.5f * std::sqrt(0.5f),
+        0.5f * std::sqrt(0.5f + 0.2f),
+        0.5f * std::sqrt(0.5f - 0.2f),
+    };
+    // the ym2203 outputs are fm and ssg a/b/c, give them some panning
+    static const float YM2203_GAIN[][2] = {
+        { 1, 1 },
+        { YM2203_PAN[0], YM2203_PAN[0] },
+        { -YM2203_PAN[1], -YM2203_PAN[2] },
+        { YM2203_PAN[2], YM2203_PAN[1] },
+    };
+
+    // init chips
+    if (header.ym2612_clock) {
+        header.ym2612_clock &= 0x7fffffff;
+        m_info.ym2612_clock = header.ym2612_clock;
+        ym2612.init(header.ym2612_clock);
+        m_mixer.activate(Mixer::YM2612, 2, m_volume, STEREO);
+    }
+    if (header.ym2203_clock) {
+        header.ym2203_clock &= 0x3fffffff;
+        m_info.ym2203_clock = header.ym2203_clock;
+        ym2203.init(header.ym2203_clock);
+        ym2203_simple.set_clock(header.ym2203_clock);
+        // set_quality picks one of them
+        m_mixer.activate(Mixer::YM2203_SIMPLE, 2, 1, STEREO);
+        m_mixer.activate(Mixer::YM2203, 4, m_volume, YM2203_GAIN);
+    }
+    if (header.ym2151_clock) {
+        m_info.ym2151_clock = header.ym2151_clock;
+        ym2151.init(header.ym2151_clock);
+        m_mixer.activate(Mixer::YM2151, 2, m_volume, STEREO);
+    }
+    if (header.rf5c68_clock) {
+        m_info.rf5c68_clock = header.rf5c68_clock;
+        rf5c68.time.set(header.rf5c68_clock, RF5C68::CLOCK_DIVIDER);
+        m_mixer.activate(Mixer::RF5C68, 2, m_volume, STEREO);
+    }
+    if (header.version >= 0x161 && header.lr35902_clock) {
+        m_info.lr35902_clock = header.lr35902_clock;
+        lr35902.time.set(header.lr35902_clock, LR35902::CLOCK_DIVIDER);
+        m_mixer.activate(Mixer::LR35902, 2, m_volume, STEREO);
+    }
+    if (header.version >= 0x171 && header.ga20_clock) {
+        m_info.ga20_clock = header.ga20_clock;
+        ga20.time.set(header.ga20_clock, GA20::CLOCK_DIVIDER);
+        m_mixer.activate(Mixer::GA20, 2, m_volume, STEREO);
+    }
+
+    // a pass is recorded after the first loop point and can be replayed from the second on.
+    // the ymfm chips and the simple ym2203 have counters that run all the time, so their
+    // state never repeats and there is no point in setting aside the buffer
+    bool fm = m_info.ym2612_clock || m_info.ym2151_clock || m_info.ym2203_clock;
+    if (m_loop_reuse && !fm && !m_stems_enabled && m_loop_pos && loop_count > 2
+    &&  header.loop_samples > 0 && header.loop_samples <= LOOP_BUFFER_MAX) {
+        m_loop_buffer.reserve(header.loop_samples * 2);
+    }
+
+    set_quality(m_quality);
+    if (m_stems_enabled) init_stems();
+
+    return true;
+}
+
+void VGM::restart() {
+    VGMHeader const& header = *(VGMHeader const*)m_data.data();
+    m_loop_counter = m_loop_count;
+    m_done         = false;
+    m_position     = 0;
+    m_pos          = 0x34 + header.data_offset;
+    m_samples_left = 0;
+    for (PcmBank& bank : m_banks) bank.clear();
+    m_dac_pos = 0;
+    m_dac_ptr = nullptr;
+    m_dac_end = nullptr;
+    std::fill(m_streams, m_streams + m_stream_count, DacStream());
+    m_stream_count = 0;
+    m_at_loop      = false;
+    m_recording    = false;
+    m_replay       = false;
+    m_loop_misses  = 0;
+    m_loop_state.clear();
+    m_loop_buffer.clear();
+}
+
+void VGM::seek(uint64_t frame) {
+    if (frame < m_position) {
+        restart();
+        ym2612.reset();
+        ym2151.reset();
+        ym2203.reset();
+        ym2203_simple.reset();
+        rf5c68.reset();
+        ga20.reset();
+        lr35902.reset();
+    }
+    // render without mixing
+    while (m_position < frame && !m_done) {
+        render((float*)nullptr, std::min<uint64_t>(frame - m_position, Mixer::BLOCK), nullptr);
+    }
+}
+
+
+void VGM::set_quality(int level) {
+    // a recorded loop no longer sounds like the next one. a loop that is being replayed just goes on
+    if (level != m_quality) {
+        m_recording = false;
+        m_loop_state.clear();
+    }
+    m_quality = level;
+    bool interpolate = level >= 2;
+    ym2612.interpolate  = interpolate;
+    ym2151.interpolate  = interpolate;
+    ym2203.interpolate  = interpolate;
+    rf5c68.interpolate  = interpolate;
+    ga20.interpolate    = interpolate;
+    lr35902.interpolate = interpolate;
+    if (ym2203.clock) {
+        static const ymfm::opn_fidelity FIDELITY[] = {
+            ymfm::OPN_FIDELITY_MIN,
+            ymfm::OPN_FIDELITY_MIN,
+            ymfm::OPN_FIDELITY_MED,
+            ymfm::OPN_FIDELITY_MAX,
+        };
+        ym2203.chip.set_fidelity(FIDELITY[level]);
+        ym2203.update_rate();
+        m_mixer.input(Mixer::YM2203).active        = level > 0;
+        m_mixer.input(Mixer::YM2203_SIMPLE).active = level == 0;
+    }
+}
+
+char const* VGM::quality_name(int level) {
+    static char const* const NAMES[] = {
+        "simple ym2203",
+        "ymfm minimum fidelity",
+        "ymfm medium fidelity, linear interpolation",
+        "ymfm maximum fidelity, linear interpolation",
+    };
+    return NAMES[level];
+}
+
+
+void VGM::add_stem(std::string const& name, int input, float const* left, float const* right) {
+    m_stems.push_back({ name, input, { left, right } });
+}
+
+void VGM::init_stems() {
+    static char const* const YM2203_NAMES[] = { "fm", "ssg0", "ssg1", "ssg2" };
+    for (int i = 0; i < Mixer::INPUT_COUNT; ++i) {
+        Mixer::Input& in = m_mixer.input(i);
+        if (!in.active) continue;
+        Mixer::Stem stem = { Mixer::input_name(i), i, {} };
+        for (int k = 0; k < in.outputs; ++k) stem.planes[k] = in.buf[k];
+        m_stems.push_back(stem);
+        if (!m_channel_stems) continue;
+
+        std::string prefix = stem.name + "-";
+        switch (i) {
+        case Mixer::YM2203:
+            for (int k = 0; k < in.outputs; ++k) {
+                Mixer::Stem chan = { prefix + YM2203_NAMES[k], i, {} };
+                chan.planes[k] = in.buf[k];
+                m_stems.push_back(chan);
+            }
+            break;
+        case Mixer::YM2203_SIMPLE:
+            for (int c = 0; c < YM2203::CHANNELS; ++c) {
+                std::string name = prefix + (c < 3 ? "ssg" : "fm") + std::to_string(c % 3);
+                add_stem(name, i, ym2203_simple_chan_buf[c * 2], ym2203_simple_chan_buf[c * 2 + 1]);
+            }
+            break;
+        case Mixer::RF5C68:
+            rf5c68.channels = true;
+            for (int c = 0; c < RF5C68::CHANNELS; ++c) {
+                add_stem(prefix + std::to_string(c), i, rf5c68.chan_buf[c * 2], rf5c68.chan_buf[c * 2 + 1]);
+            }
+            break;
+        case Mixer::GA20:
+            ga20.channels = true;
+            for (int c = 0; c < GA20::CHANNELS; ++c) {
+                add_stem(prefix + std::to_string(c), i, ga20.chan_buf[c * 2], ga20.chan_buf[c * 2 + 1]);
+            }
+            break;
+        case Mixer::LR35902:
+            lr35902.channels = true;
+            for (int c = 0; c < LR35902::CHANNELS; ++c) {
+                add_stem(prefix + std::to_string(c), i, lr35902.chan_buf[c * 2], lr35902.chan_buf[c * 2 + 1]);
+            }
+            break;
+        default: break;
+        }
+    }
+}
+
+
+void VGM::command() {
+    uint8_t  cmd = next();
+    uint8_t  b   = 0;
+    uint8_t  v   = 0;
+    uint32_t n   = 0;
+    switch (cmd) {
+    case 0xb0: // RF5C68, write value dd to register aa
+        b = next();
+        v = next();
+        log_write(Mixer::RF5C68, RegLog::WRITE, b, v);
+        rf5c68.chip.write_reg(b, v);
+        break;
+    case 0xb3: // LR35902, write value dd to register aa
+        b = next();
+        v = next();
+        log_write(Mixer::LR35902, RegLog::WRITE, b, v);
+        lr35902.chip.write_reg(b, v);
+        break;
+    case 0xbf: // GA20, write value dd to register aa
+        b = next();
+        v = next();
+        log_write(Mixer::GA20, RegLog::WRITE, b, v);
+        ga20.chip.write_reg(b, v);
+        break;
+    case 0x52: // YM2612 port 0, write value dd to register aa
+        b = next();
+        v = next();
+        log_write(Mixer::YM2612, RegLog::WRITE, b, v);
+        ym2612.chip.write_address(b);
+        ym2612.chip.write_data(v);
+        break;
+    case 0x53: // YM2612 port 1, write value dd to register aa
+        b = next();
+        v = next();
+        log_write(Mixer::YM2612, RegLog::WRITE_HI, b, v);
+        ym2612.chip.write_address_hi(b);
+        ym2612.chip.write_data_hi(v);
+        break;
+    case 0x54: // YM2151, write value dd to register aa
+        b = next();
+        v = next();
+        log_write(Mixer::YM2151, RegLog::WRITE, b, v);
+        ym2151.chip.write_address(b);
+        ym2151.chip.write_data(v);
+        break;
+    case 0x55: // YM2203, write value dd to register aa
+        b = next();
+        v = next();
+        // XXX: only fm voice #0
+        //if (b < 16 || (b == 0x28 && (v & 3) != 0)) break;
+        log_write(Mixer::YM2203, RegLog::WRITE, b, v);
+        ym2203.chip.write_address(b);
+        ym2203.chip.write_data(v);
+        ym2203_simple.write_reg(b, v);
+        break;
+    case 0x80: case 0x81: case 0x82: case 0x83:
+    case 0x84: case 0x85: case 0x86: case 0x87:
+    case 0x88: case 0x89: case 0x8a: case 0x8b:
+    case 0x8c: case 0x8d: case 0x8e: case 0x8f: // YM2612 DAC write from the data bank, then wait n samples
+        if (m_dac_ptr == m_dac_end) {
+            uint32_t avail = 0;
+            m_dac_ptr = m_banks[0].at(m_data.data(), m_dac_pos, avail);
+            m_dac_end = m_dac_ptr + avail;
+        }
+        if (m_dac_ptr != m_dac_end) {
+            v = *m_dac_ptr++;
+            ++m_dac_pos;
+            log_write(Mixer::YM2612, RegLog::WRITE, 0x2a, v);
+            ym2612.chip.write_address(0x2a);
+            ym2612.chip.write_data(v);
+        }
+        m_samples_left = cmd & 0xf;
+        break;
+    case 0xe0: // seek to offset dddddddd in the YM2612 data bank
+        m_dac_pos = next();
+        m_dac_pos |= next() << 8;
+        m_dac_pos |= next() << 16;
+        m_dac_pos |= next() << 24;
+        m_dac_ptr = m_dac_end = nullptr;
+        break;
+
+    case 0x90: { // DAC stream ss setup: chip type tt, port pp, register cc
+        DacStream& s = m_streams[std::min<uint8_t>(next(), 0xfe)];
+        b        = next();
+        s.ym2612 = (b & 0x7f) == 0x02;
+        s.port   = next();
+        s.reg    = next();
+        m_stream_count = std::max<uint32_t>(m_stream_count, &s - m_streams + 1);
+        break;
+    }
+    case 0x91: { // DAC stream ss data: bank dd, step size ll, step base bb
+        DacStream& s = m_streams[std::min<uint8_t>(next(), 0xfe)];
+        s.bank      = next() & 0x3f;
+        s.step_size = std::max<uint8_t>(next(), 1);
+        s.step_base = next();
+        break;
+    }
+    case 0x92: { // DAC stream ss frequency
+        DacStream& s = m_streams[std::min<uint8_t>(next(), 0xfe)];
+        s.freq = next();
+        s.freq |= next() << 8;
+        s.freq |= next() << 16;
+        s.freq |= next() << 24;
+        break;
+    }
+    case 0x93: { // DAC stream ss start at offset aaaaaaaa, length mode mm, length llllllll
+        DacStream& s = m_streams[std::min<uint8_t>(next(), 0xfe)];
+        uint32_t start = next();
+        start |= next() << 8;
+        start |= next() << 16;
+        start |= next() << 24;
+        uint8_t mode = next();
+        n = next();
+        n |= next() << 8;
+        n |= next() << 16;
+        n |= next() << 24;
+        if (start == 0xffffffff) start = s.start - s.step_base;
+        uint32_t size = m_banks[s.bank].size;
+        switch (mode & 3) {
+        case 0: // only change the position
+            s.start = start + s.step_base;
+            s.pos   = s.start;
+            break;
+        case 1: // number of writes
+            s.loop    = mode & 0x80;
+            s.reverse = mode & 0x10;
+            start_stream(s, start, n);
+            break;
+        case 2: // milliseconds
+            s.loop    = mode & 0x80;
+            s.reverse = mode & 0x10;
+            start_stream(s, start, uint64_t(n) * s.freq / 1000);
+            break;
+        case 3: // up to the end of the data
+            s.loop    = mode & 0x80;
+            s.reverse = mode & 0x10;
+            start_stream(s, start, s.reverse ? start / s.step_size + 1 :
+                                   start < size ? (size - start + s.step_size - 1) / s.step_size : 0);
+            break;
+        }
+        break;
+    }
+    case 0x94: // DAC stream ss stop, ff stops all
+        b = next();
+        if (b == 0xff) {
+            for (uint32_t i = 0; i < m_stream_count; ++i) m_streams[i].playing = false;
+        }
+        else {
+            m_streams[std::min<uint8_t>(b, 0xfe)].playing = false;
+        }
+        break;
+    case 0x95: { // DAC stream ss start with block bbbb of its bank, flags ff
+        DacStream& s = m_streams[std::min<uint8_t>(next(), 0xfe)];
+        n = next();
+        n |= next() << 8;
+        b = next();
+        PcmBank const& bank = m_banks[s.bank];
+        if (n >= bank.blocks.size()) {
+            s.playing = false;
+            break;
+        }
+        s.loop    = b & 0x01;
+        s.reverse = b & 0x10;
+        uint32_t start = bank.blocks[n].start;
+        uint32_t size  = bank.blocks[n].size;
+        if (s.reverse) start += size - 1;
+        start_stream(s, start, (size + s.step_size - 1) / s.step_size);
+        break;
+    }
+
+    case 0x67: // data block
+        next();
+        b = next();
+        n = next();
+        n |= next() << 8;
+        n |= next() << 16;
+        n |= next() << 24;
+        if (b == 0xc0) { // rf5c68
+            uint16_t addr = next();
+            addr |= next() << 8;
+            if (m_logs && n > 2) log_block(Mixer::RF5C68, addr, n - 2);
+            for (; n > 2; --n) rf5c68.chip.write_mem(addr++, next());
+        }
+        else if (b == 0x93) { // ga20 rom
+            uint32_t rom = next();
+            rom |= next() << 8;
+            rom |= next() << 16;
+            rom |= next() << 24;
+            (void)rom;
+
+            uint32_t addr = next();
+            addr |= next() << 8;
+            addr |= next() << 16;
+            addr |= next() << 24;
+            if (m_logs && n > 8) log_block(Mixer::GA20, addr, n - 8);
+            for (; n > 8; --n) ga20.chip.write_mem(addr++, next());
+        }
+        else if (b < 0x40) { // uncompressed PCM, stays in the song data
+            m_banks[b].add(m_pos, std::min<uint32_t>(n, m_data.size() - std::min<uint32_t>(m_pos, m_data.size())));
+            m_pos += n;
+        }
+        else {
+            log_message("warning: unknown data block %02x %04x\n", b, n);
+            m_pos += n;
+        }
+        if (m_analysis) m_analysis->block(b, n);
+        break;
+
+    case 0x61: // wait n samples
+        m_samples_left = next();
+        m_samples_left |= next() << 8;
+        break;
+    case 0x62:
+        m_samples_left = MIXRATE / 60;
+        break;
+    case 0x63:
+        m_samples_left = MIXRATE / 50;
+        break;
+    case 0x70: case 0x71: case 0x72: case 0x73:
+    case 0x74: case 0x75: case 0x76: case 0x77:
+    case 0x78: case 0x79: case 0x7a: case 0x7b:
+    case 0x7c: case 0x7d: case 0x7e: case 0x7f:
+        m_samples_left = (cmd & 0xf) + 1;
+        break;
+
+    case 0x66: // end of sound data
+        if (m_loop_pos) {
+            m_pos = m_loop_pos;
+            if (--m_loop_counter > 0) {
+                log_message("looping\n");
+                m_at_loop = true;
+                break;
+            }
+        }
+        log_message("done\n");
+        m_done = true;
+        break;
+
+    default:
+        log_message("error: unknown command %02x\n", cmd);
+        if (m_analysis) m_analysis->unknown(cmd, m_pos - 1);
+        m_done = true;
+        break;
+    }
+    if (m_analysis) m_analysis->command(cmd, m_samples_left);
+}
+
+void VGM::log_block(int chip, uint32_t addr, uint32_t n) {
+    n = std::min<uint32_t>(n, m_data.size() - std::min<uint32_t>(m_pos, m_data.size()));
+    m_logs[chip].block(m_position, addr, m_data.data() + m_pos, n);
+}
+
+void VGM::scan() {
+    while (!m_done) {
+        command();
+        m_at_loop = false;
+        if (m_stream_count) render_ym2612(m_samples_left, false);
+        m_position += m_samples_left;
+        m_samples_left = 0;
+    }
+    for (int i = 0; m_logs && i < Mixer::INPUT_COUNT; ++i) m_logs[i].finish(m_position);
+    if (m_analysis) m_analysis->finish(m_position);
+}
+
+void VGM::analyze_write(int chip, RegLog::Op op, uint8_t a, uint32_t offset) {
+    m_analysis->write(chip, op == RegLog::WRITE_HI, a, m_position + offset);
+}
+
+void VGM::start_stream(DacStream& s, uint32_t start, uint32_t length) {
+    s.start     = start + s.step_base;
+    s.pos       = s.start;
+    s.length    = length;
+    s.remaining = length;
+    s.playing   = s.ym2612 && length > 0;
+    s.acc       = MIXRATE; // the first write is due right away
+}
+
+void VGM::stream_write(DacStream& s, uint32_t offset) {
+    uint32_t       avail;
+    uint8_t const* p = m_banks[s.bank].at(m_data.data(), s.pos, avail);
+    if (p) {
+        log_write(Mixer::YM2612, s.port ? RegLog::WRITE_HI : RegLog::WRITE, s.reg, *p, offset);
+        if (s.port) {
+            ym2612.chip.write_address_hi(s.reg);
+            ym2612.chip.write_data_hi(*p);
+        }
+        else {
+            ym2612.chip.write_address(s.reg);
+            ym2612.chip.write_data(*p);
+        }
+    }
+    s.pos += s.reverse ? -s.step_size : s.step_size;
+    if (--s.remaining > 0) return;
+    if (s.loop) {
+        s.pos       = s.start;
+        s.remaining = s.length;
+    }
+    else {
+        s.playing = false;
+    }
+}
+
+// the DAC streams write at their own frequency, so the YM2612 is rendered
+// in pieces from one due write to the next. without render, only the writes happen
+void VGM::render_ym2612(uint32_t n, bool render) {
+    Mixer::Input& in = m_mixer.input(Mixer::YM2612);
+    for (uint32_t i = 0; i < n;) {
+        uint32_t span = n - i;
+        for (uint32_t k = 0; k < m_stream_count; ++k) {
+            DacStream& s = m_streams[k];
+            while (s.playing && s.acc >= MIXRATE) {
+                s.acc -= MIXRATE;
+                stream_write(s, i);
+            }
+            if (s.playing && s.freq) span = std::min<uint64_t>(span, (MIXRATE - s.acc + s.freq - 1) / s.freq);
+        }
+        if (render) ym2612.render(in, span, i);
+        for (uint32_t k = 0; k < m_stream_count; ++k) {
+            if (m_streams[k].playing) m_streams[k].acc += uint64_t(m_streams[k].freq) * span;
+        }
+        i += span;
+    }
+}
+
+void VGM::render_block(uint32_t n) {
+    if (m_mixer.input(Mixer::YM2612).active) render_ym2612(n);
+    if (m_mixer.input(Mixer::YM2151).active) ym2151.render(m_mixer.input(Mixer::YM2151), n);
+    if (m_mixer.input(Mixer::YM2203).active) ym2203.render(m_mixer.input(Mixer::YM2203), n);
+    if (m_mixer.input(Mixer::RF5C68).active) rf5c68.render(m_mixer.input(Mixer::RF5C68), n);
+    if (m_mixer.input(Mixer::GA20).active) ga20.render(m_mixer.input(Mixer::GA20), n);
+    if (m_mixer.input(Mixer::LR35902).active) lr35902.render(m_mixer.input(Mixer::LR35902), n);
+    if (m_mixer.input(Mixer::YM2203_SIMPLE).active) {
+        Mixer::Input& in = m_mixer.input(Mixer::YM2203_SIMPLE);
+        for (uint32_t i = 0; i < n; ++i) {
+            float out[2] = {};
+            ym2203_simple.render(out, m_channel_stems ? ym2203_simple_chan_out : nullptr);
+            in.buf[0][i] = out[0];
+            in.buf[1][i] = out[1];
+            for (int c = 0; m_channel_stems && c < YM2203::CHANNELS * 2; ++c) {
+                ym2203_simple_chan_buf[c][i] = ym2203_simple_chan_out[c];
+            }
+        }
+    }
+}
+
+// everything the output after the loop point depends on
+void VGM::save_state(std::vector<uint8_t>& state) {
+    auto add = [&state](void const* p, size_t size) {
+        state.insert(state.end(), (uint8_t const*)p, (uint8_t const*)p + size);
+    };
+    // ymfm starts saving by emptying the vector, so each chip is saved on its own first
+    auto add_ymfm = [&](auto& r) {
+        ymfm::ymfm_saved_state saved(m_chip_state, true);
+        r.chip.save_restore(saved);
+        add(m_chip_state.data(), m_chip_state.size());
+        add(&r.out, sizeof(r.out));
+        add(&r.prev, sizeof(r.prev));
+        add(&r.time.acc, sizeof(r.time.acc));
+    };
+    auto add_int = [&](auto& r) {
+        add(&r.chip, sizeof(r.chip));
+        add(&r.out, sizeof(r.out));
+        add(&r.prev, sizeof(r.prev));
+        add(&r.time.acc, sizeof(r.time.acc));
+    };
+    state.clear();
+    if (m_info.ym2612_clock) add_ymfm(ym2612);
+    if (m_info.ym2151_clock) add_ymfm(ym2151);
+    if (m_info.ym2203_clock) {
+        add_ymfm(ym2203);
+        add(&ym2203_simple, sizeof(ym2203_simple));
+    }
+    if (m_info.rf5c68_clock)  add_int(rf5c68);
+    if (m_info.ga20_clock)    add_int(ga20);
+    if (m_info.lr35902_clock) add_int(lr35902);
+    add(&m_dac_pos, sizeof(m_dac_pos));
+    add(&m_stream_count, sizeof(m_stream_count));
+    add(m_streams, m_stream_count * sizeof(DacStream));
+}
+
+// if the chips come back to the loop point in the same state as last time, the
+// next pass sounds exactly like the previous one, which was recorded, and all
+// remaining passes are replayed from the recording
+void VGM::loop_point() {
+    m_at_loop = false;
+    if (m_loop_buffer.capacity() == 0 || m_loop_misses >= LOOP_MISSES) return;
+    save_state(m_state);
+    if (m_recording && m_state == m_loop_state) {
+        m_recording  = false;
+        m_replay     = true;
+        m_replay_pos = 0;
+        return;
+    }
+    // chips that don't come back to the same state after a pass or two, like the ymfm ones
+    // with their free-running envelope clock, won't later on either
+    if (m_recording && ++m_loop_misses >= LOOP_MISSES) {
+        stop_loop_reuse();
+        return;
+    }
+    std::swap(m_state, m_loop_state);
+    m_loop_buffer.clear();
+    // recording only pays off if there is a pass after this one
+    m_recording = m_loop_counter > 1;
+}
+
+// give back the memory of loop reuse for the rest of the song
+void VGM::stop_loop_reuse() {
+    m_recording = false;
+    m_loop_buffer = std::pmr::vector<float>(m_loop_buffer.get_allocator());
+    std::vector<uint8_t>().swap(m_state);
+    std::vector<uint8_t>().swap(m_loop_state);
+    std::vector<uint8_t>().swap(m_chip_state);
+}
+
+// apply the fade to n frames from the current position
+void VGM::fade(float* buffer, uint32_t n) const {
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t pos  = m_position + i;
+        float    gain = pos < m_fade_end ? std::min(1.0f, (m_fade_end - pos) / float(m_fade)) : 0.0f;
+        buffer[i * 2 + 0] *= gain;
+        buffer[i * 2 + 1] *= gain;
+    }
+}
+
+template<class T>
+uint32_t VGM::render(T* buffer, uint32_t sample_count, float* const* stems) {
+    uint32_t rendered = 0;
+    while (sample_count > 0) {
+        if (!m_replay) {
+            while (!m_done && m_samples_left == 0) {
+                command();
+                if (m_at_loop) loop_point();
+            }
+        }
+        else if (m_replay_pos == m_loop_buffer.size()) {
+            // the end of the sound data once more
+            m_replay_pos = 0;
+            if (--m_loop_counter > 0) {
+                log_message("looping\n");
+            }
+            else {
+                log_message("done\n");
+                m_done = true;
+            }
+        }
+        if (m_done) {
+            if (stems) {
+                for (size_t s = 0; s < m_stems.size(); ++s) {
+                    std::fill(stems[s] + rendered * 2, stems[s] + (rendered + sample_count) * 2, 0.0f);
+                }
+            }
+            if (buffer) std::fill(buffer, buffer + sample_count * 2, 0);
+            return rendered;
+        }
+
+        uint32_t samples;
+        float    mix[Mixer::BLOCK * 2];
+        if (m_replay) {
+            samples = std::min<size_t>({ sample_count, Mixer::BLOCK, (m_loop_buffer.size() - m_replay_pos) / 2 });
+            if (buffer) std::copy_n(m_loop_buffer.data() + m_replay_pos, samples * 2, mix);
+            m_replay_pos += samples * 2;
+        }
+        else {
+            samples = std::min({ sample_count, m_samples_left, uint32_t(Mixer::BLOCK) });
+            render_block(samples);
+            if (buffer || m_recording) m_mixer.mix(mix, samples);
+            if (m_recording) {
+                // a pass longer than the header says isn't replayed, and the buffer never grows
+                if (m_loop_buffer.size() + samples * 2 > m_loop_buffer.capacity()) {
+                    stop_loop_reuse();
+                }
+                else {
+                    m_loop_buffer.insert(m_loop_buffer.end(), mix, mix + samples * 2);
+                }
+            }
+            for (size_t s = 0; stems && s < m_stems.size(); ++s) {
+                m_mixer.mix_stem(m_stems[s], stems[s] + rendered * 2, samples);
+            }
+            m_samples_left -= samples;
+        }
+        // the stems fade out with the mix, so that they still add up to it
+        bool fading = m_fade_end && m_position + samples > m_fade_end - std::min<uint64_t>(m_fade, m_fade_end);
+        for (size_t s = 0; fading && stems && s < m_stems.size(); ++s) {
+            fade(stems[s] + rendered * 2, samples);
+        }
+        if (buffer) {
+            if (fading) fade(mix, samples);
+            m_mixer.output(mix, buffer, samples);
+            buffer += samples * 2;
+        }
+        m_position += samples;
+        sample_count -= samples;
+        rendered += samples;
+    }
+    return rendered;
+}
+
+uint32_t VGM::render(float* buffer, uint32_t sample_count, float* const* stems) {
+    return render<float>(buffer, sample_count, stems);
+}
+
+uint32_t VGM::render(int16_t* buffer, uint32_t sample_count) {
+    return render<int16_t>(buffer, sample_count, nullptr);
+}
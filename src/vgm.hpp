@@ -0,0 +1,369 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <memory_resource>
+
+#include "ymfm_opm.h"
+#include "ymfm_opn.h"
+
+#include "ga20.hpp"
+#include "rf5c68.hpp"
+#include "ym2203.hpp"
+#include "lr35902.hpp"
+#include "mixer.hpp"
+#include "reglog.hpp"
+#include "log.hpp"
+
+
+enum { MIXRATE = 44100 };
+
+class Analysis;
+
+// The native samples of a chip per output sample as an exact fraction,
+// clock / (divider * MIXRATE). acc is the time since the last native sample in
+// units of 1 / (clock * MIXRATE) s, so it never drifts, and the number of
+// native samples in any span of output is known up front.
+struct Timebase {
+    uint64_t clock  = 0;
+    uint64_t period = MIXRATE; // a native sample, divider * MIXRATE units of acc
+    uint64_t acc    = 0;
+
+    // keeps the position between native samples if the rate changes while playing
+    void set(uint64_t clock, uint64_t divider = 1) {
+        uint64_t period = divider * MIXRATE;
+        acc          = acc * period / this->period;
+        this->clock  = clock;
+        this->period = period;
+    }
+    // from a rate that is the clock over a whole divider, rounded down to whole Hz
+    void set_rate(uint64_t clock, uint64_t rate) {
+        if (rate) set(clock, (clock + rate / 2) / rate);
+    }
+    // the native samples in the next n output samples, without moving on
+    uint64_t samples(uint64_t n) const { return (acc + n * clock) / period; }
+    // move on by n output samples and return the native samples in them.
+    // the resamplers call this for every output sample, where it mostly comes to 0 or 1
+    uint64_t advance(uint64_t n = 1) {
+        acc += n * clock;
+        if (acc < period) return 0;
+        if (acc < 2 * period) {
+            acc -= period;
+            return 1;
+        }
+        uint64_t s = acc / period;
+        acc -= s * period;
+        return s;
+    }
+    // how far we are from the previous to the next native sample
+    float frac() const { return acc / float(period); }
+};
+
+template<class Chip>
+struct IntResampler {
+    Chip     chip;
+    int      out[2] = {};
+    int      prev[2] = {};
+    int      chan_out[Chip::CHANNELS * 2] = {};
+    bool     channels = false; // fill chan_buf
+    bool     interpolate = false;
+    Timebase time;
+    float    chan_buf[Chip::CHANNELS * 2][Mixer::BLOCK];
+    void reset() {
+        chip.reset();
+        time.acc = 0;
+        std::fill(out, out + 2, 0);
+        std::fill(prev, prev + 2, 0);
+        std::fill(chan_out, chan_out + Chip::CHANNELS * 2, 0);
+    }
+    void advance() {
+        for (uint64_t s = time.advance(); s > 0; --s) {
+            prev[0] = out[0];
+            prev[1] = out[1];
+            chip.generate(out, channels ? chan_out : nullptr);
+        }
+    }
+    void render(Mixer::Input& in, uint32_t n) {
+        for (uint32_t i = 0; i < n; ++i) {
+            advance();
+            if (interpolate) {
+                float f = time.frac();
+                in.buf[0][i] = prev[0] + (out[0] - prev[0]) * f;
+                in.buf[1][i] = prev[1] + (out[1] - prev[1]) * f;
+            }
+            else {
+                in.buf[0][i] = out[0];
+                in.buf[1][i] = out[1];
+            }
+            for (int c = 0; channels && c < Chip::CHANNELS * 2; ++c) chan_buf[c][i] = chan_out[c];
+        }
+    }
+};
+
+template<class Chip, int N = 2>
+struct YmfmResampler {
+    ymfm::ymfm_interface iface;
+    ymfm::ymfm_output<N> out  = {};
+    ymfm::ymfm_output<N> prev = {};
+    Chip                 chip{iface};
+    bool                 interpolate = false;
+    uint32_t             clock = 0;
+    Timebase             time;
+    void init(uint32_t clock) {
+        this->clock = clock;
+        reset();
+        update_rate();
+    }
+    void reset() {
+        chip.reset();
+        time.acc = 0;
+        out      = {};
+        prev     = {};
+    }
+    // the sample rate depends on the fidelity
+    void update_rate() {
+        time.set_rate(clock, chip.sample_rate(clock));
+    }
+    void advance() {
+        for (uint64_t s = time.advance(); s > 0; --s) {
+            prev = out;
+            chip.generate(&out);
+        }
+    }
+    // fill n samples of in, starting at first
+    void render(Mixer::Input& in, uint32_t n, uint32_t first = 0) {
+        for (uint32_t i = first; i < first + n; ++i) {
+            advance();
+            float f = time.frac();
+            for (int k = 0; k < N; ++k) {
+                in.buf[k][i] = interpolate ? prev.data[k] + (out.data[k] - prev.data[k]) * f : out.data[k];
+            }
+        }
+    }
+};
+
+// The data blocks of one type, one after the other. The data stays in the
+// song and is only referenced from here.
+struct PcmBank {
+    struct Block {
+        uint32_t start; // in the bank
+        uint32_t data;  // in the song data
+        uint32_t size;
+    };
+    std::pmr::vector<Block> blocks;
+    uint32_t                size = 0;
+    mutable size_t          last = 0; // the block of the previous lookup
+
+    explicit PcmBank(std::pmr::memory_resource* resource) : blocks(resource) {}
+    void clear() {
+        blocks.clear();
+        size = 0;
+        last = 0;
+    }
+    void add(uint32_t data, uint32_t n) {
+        // blocks after the loop point come again on every loop
+        if (n == 0 || (!blocks.empty() && data <= blocks.back().data)) return;
+        blocks.push_back({ size, data, n });
+        size += n;
+    }
+    // the byte at pos and the number of bytes following it in the same block,
+    // or null if pos is out of range
+    uint8_t const* at(uint8_t const* song, uint32_t pos, uint32_t& avail) const {
+        if (pos >= size) return nullptr;
+        if (pos < blocks[last].start || pos - blocks[last].start >= blocks[last].size) {
+            auto it = std::upper_bound(blocks.begin(), blocks.end(), pos,
+                                       [](uint32_t p, Block const& b) { return p < b.start; });
+            last = it - blocks.begin() - 1;
+        }
+        Block const& b = blocks[last];
+        avail = b.size - (pos - b.start);
+        return song + b.data + (pos - b.start);
+    }
+};
+
+// A DAC stream (commands 0x90-0x95) writes bytes of a PCM bank to a chip
+// register at a fixed frequency. Only YM2612 streams are played.
+struct DacStream {
+    bool     ym2612    = false;
+    bool     playing   = false;
+    bool     loop      = false;
+    bool     reverse   = false;
+    uint8_t  port      = 0;
+    uint8_t  reg       = 0;
+    uint8_t  bank      = 0;
+    uint8_t  step_size = 1;
+    uint8_t  step_base = 0;
+    uint32_t freq      = 0;
+    uint32_t start     = 0; // of the current run, in the bank
+    uint32_t length    = 0; // number of writes of a run
+    uint32_t pos       = 0;
+    uint32_t remaining = 0;
+    uint64_t acc       = 0; // a write is due when this reaches MIXRATE; it grows by freq per sample
+};
+
+// A VGM player instance. Instances share no state, so different instances
+// can be used from different threads at the same time; a single instance
+// must only be used by one thread at a time. Each instance queues its own
+// messages in log(), which the owner drains from any one thread.
+class VGM {
+public:
+    struct Info {
+        uint32_t version;
+        uint32_t total_samples;
+        uint32_t loop_samples;
+        float    volume;
+        uint32_t ym2612_clock;
+        uint32_t ym2151_clock;
+        uint32_t ym2203_clock;
+        uint32_t rf5c68_clock;
+        uint32_t ga20_clock;
+        uint32_t lr35902_clock;
+        // from the GD3 tag, in UTF-8
+        std::pmr::string title;
+        std::pmr::string game;
+        std::pmr::string system;
+        std::pmr::string author;
+        std::pmr::string date;
+    };
+
+    // the song data and the tag strings are allocated from resource
+    explicit VGM(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+    // loop_count is the number of times the song is played. init must only be called once.
+    // on failure, error() describes what went wrong
+    bool init(char const* filename, int loop_count);
+    bool init(void const* data, size_t size, int loop_count);
+    char const* error() const { return m_error; }
+    Info const& info() const { return m_info; }
+    // 0: simple ym2203, 1: ymfm ym2203 at minimum fidelity (default),
+    // 2: medium fidelity and linear interpolation, 3: maximum fidelity.
+    // can be changed while playing
+    enum { QUALITY_LEVELS = 4 };
+    // bump this whenever a change to the player or a chip core changes the rendered output,
+    // so that cached renders of the old output are no longer used
+    enum { RENDER_VERSION = 1 };
+    void set_quality(int level);
+    int quality() const { return m_quality; }
+    static char const* quality_name(int level);
+    Mixer& mixer() { return m_mixer; }
+    // also output each chip, and optionally each chip channel, separately.
+    // must be called before init
+    void enable_stems(bool channels) { m_stems_enabled = true; m_channel_stems = channels; }
+    size_t stem_count() const { return m_stems.size(); }
+    char const* stem_name(size_t i) const { return m_stems[i].name.c_str(); }
+    bool done() const { return m_done; }
+    // stems, if given, points to stem_count() stereo buffers of sample_count frames
+    uint32_t render(float* buffer, uint32_t sample_count, float* const* stems = nullptr);
+    uint32_t render(int16_t* buffer, uint32_t sample_count);
+    // number of frames rendered so far
+    uint64_t position() const { return m_position; }
+    // seeking backwards replays the song from the start
+    void seek(uint64_t frame);
+    // record the register writes and data blocks of each chip into logs, which is indexed
+    // by mixer input (the YM2203 log also covers the simple YM2203). null stops recording
+    void record(RegLog* logs) { m_logs = logs; }
+    // gather statistics of the commands into analysis (see analyze.hpp). null stops it
+    void analyze(Analysis* analysis) { m_analysis = analysis; }
+    // go through the commands up to the end without rendering anything
+    void scan();
+    // fade out over the last seconds of the last loop, by the loop length in the header.
+    // must be called before init
+    void set_fade(float seconds) { m_fade = seconds * MIXRATE; }
+    // replay the later passes of a looping song from a recording of the previous pass, once the
+    // chips come back to the loop point in the same state. this is for offline rendering: the
+    // state at each loop point is saved and compared, and the recording takes up to 100 MB.
+    // songs for the fm chips never come back to the same state and are left alone.
+    // must be called before init
+    void enable_loop_reuse() { m_loop_reuse = true; }
+    // messages like "looping" or warnings, queued without blocking while rendering
+    LogQueue& log() { return m_log; }
+
+private:
+    uint8_t next() {
+        if (m_pos >= m_data.size()) return 0;
+        return m_data[m_pos++];
+    }
+
+    bool parse(int loop_count);
+    void restart();
+    void command();
+    void save_state(std::vector<uint8_t>& state);
+    void loop_point();
+    void stop_loop_reuse();
+    void fade(float* buffer, uint32_t n) const;
+    void log_write(int chip, RegLog::Op op, uint8_t a, uint8_t v, uint32_t offset = 0) {
+        if (m_logs) m_logs[chip].write(m_position + offset, op, a, v);
+        if (m_analysis) analyze_write(chip, op, a, offset);
+    }
+    void analyze_write(int chip, RegLog::Op op, uint8_t a, uint32_t offset);
+    void log_block(int chip, uint32_t addr, uint32_t n);
+    void log_message(char const* fmt, int a = 0, int b = 0, int c = 0, int d = 0) { m_log.push(fmt, a, b, c, d); }
+
+    void add_stem(std::string const& name, int input, float const* left, float const* right);
+    void init_stems();
+    void start_stream(DacStream& s, uint32_t start, uint32_t length);
+    void stream_write(DacStream& s, uint32_t offset);
+    void render_ym2612(uint32_t n, bool render = true);
+    void render_block(uint32_t n);
+    template<class T>
+    uint32_t render(T* buffer, uint32_t sample_count, float* const* stems);
+
+    char                      m_error[64] = {};
+    Info                      m_info;
+    bool                      m_done          = true;
+    int                       m_quality       = 1;
+    bool                      m_stems_enabled = false;
+    bool                      m_channel_stems = false;
+    std::vector<Mixer::Stem>  m_stems;
+    Mixer                     m_mixer;
+    std::pmr::vector<uint8_t> m_data;
+    uint64_t                  m_position      = 0;
+    uint32_t                  m_pos           = 0;
+    uint32_t                  m_loop_pos      = 0;
+    uint32_t                  m_samples_left  = 0;
+    float                     m_volume        = 0;
+    int                       m_loop_count    = 0;
+    int                       m_loop_counter  = 0;
+    RegLog*                   m_logs          = nullptr;
+    Analysis*                 m_analysis      = nullptr;
+
+    // the data blocks of types 0x00-0x3f, and the YM2612 DAC read position of the 0x8n
+    // commands, with a pointer to it and the end of its block
+    std::pmr::vector<PcmBank> m_banks;
+    uint32_t                  m_dac_pos       = 0;
+    uint8_t const*            m_dac_ptr       = nullptr;
+    uint8_t const*            m_dac_end       = nullptr;
+    DacStream                 m_streams[0xff];
+    uint32_t                  m_stream_count  = 0; // streams below this may be playing
+
+    // loop reuse: the chip state at the previous loop point, the output since then,
+    // and where replaying it has got to. the buffer is reserved for one pass at init
+    enum { LOOP_BUFFER_MAX = MIXRATE * 60 * 5, LOOP_MISSES = 2 };
+    bool                      m_loop_reuse    = false;
+    int                       m_loop_misses   = 0;
+    bool                      m_at_loop       = false;
+    bool                      m_recording     = false;
+    bool                      m_replay        = false;
+    std::vector<uint8_t>      m_state;
+    std::vector<uint8_t>      m_loop_state;
+    std::vector<uint8_t>      m_chip_state;   // for saving a single ymfm chip
+    std::pmr::vector<float>   m_loop_buffer;
+    size_t                    m_replay_pos    = 0;
+    uint32_t                  m_fade          = 0;
+    uint64_t                  m_fade_end      = 0;
+    LogQueue                  m_log{};
+
+    // chips
+    YmfmResampler<ymfm::ym3438>    ym2612;
+    YmfmResampler<ymfm::ym2151>    ym2151;
+    YmfmResampler<ymfm::ym2203, 4> ym2203;
+    YM2203                         ym2203_simple;
+    float                          ym2203_simple_chan_out[YM2203::CHANNELS * 2];
+    float                          ym2203_simple_chan_buf[YM2203::CHANNELS * 2][Mixer::BLOCK];
+    IntResampler<RF5C68>           rf5c68;
+    IntResampler<GA20>             ga20;
+    IntResampler<LR35902>          lr35902;
+};
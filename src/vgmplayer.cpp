@@ -0,0 +1,185 @@
+#include <cstdio>
+#include <algorithm>
+#include <new>
+#include <memory_resource>
+
+#include "vgmplayer.h"
+#include "vgm.hpp"
+
+static_assert(int(VGM_SAMPLE_RATE) == int(MIXRATE), "sample rate mismatch");
+
+
+// forwards a vgm_allocator to the pmr interface used by VGM
+class AllocatorResource : public std::pmr::memory_resource {
+public:
+    explicit AllocatorResource(vgm_allocator const& allocator) : m_allocator(allocator) {}
+    vgm_allocator const& allocator() const { return m_allocator; }
+private:
+    void* do_allocate(size_t bytes, size_t align) override {
+        void* p = m_allocator.alloc(m_allocator.user, bytes, align);
+        if (!p) throw std::bad_alloc();
+        return p;
+    }
+    void do_deallocate(void* p, size_t bytes, size_t align) override {
+        m_allocator.free(m_allocator.user, p, bytes, align);
+    }
+    bool do_is_equal(memory_resource const& other) const noexcept override {
+        return this == &other;
+    }
+    vgm_allocator m_allocator;
+};
+
+struct vgm_player {
+    explicit vgm_player(vgm_allocator const& allocator) : resource(allocator), vgm(&resource) {}
+    AllocatorResource resource;
+    VGM               vgm;
+    vgm_info          info;
+    bool              failed = false; // ran out of memory while rendering or seeking
+};
+
+
+static void* default_alloc(void* user, size_t size, size_t align) {
+    return ::operator new(size, std::align_val_t(align), std::nothrow);
+}
+
+static void default_free(void* user, void* ptr, size_t size, size_t align) {
+    ::operator delete(ptr, std::align_val_t(align));
+}
+
+static vgm_allocator const DEFAULT_ALLOCATOR = { default_alloc, default_free, nullptr };
+
+
+static vgm_player* create(vgm_options const* options) {
+    vgm_options defaults;
+    vgm_default_options(&defaults);
+    if (!options) options = &defaults;
+    vgm_allocator const& allocator = options->allocator ? *options->allocator : DEFAULT_ALLOCATOR;
+    void* p = allocator.alloc(allocator.user, sizeof(vgm_player), alignof(vgm_player));
+    if (!p) return nullptr;
+    vgm_player* player;
+    try {
+        // VGM already allocates from the allocator when it is constructed
+        player = new (p) vgm_player(allocator);
+    }
+    catch (std::bad_alloc const&) {
+        allocator.free(allocator.user, p, sizeof(vgm_player), alignof(vgm_player));
+        return nullptr;
+    }
+    player->vgm.set_quality(std::min(std::max(options->quality, 0), VGM::QUALITY_LEVELS - 1));
+    return player;
+}
+
+template<class Init>
+static vgm_player* open(vgm_options const* options, char const** error, Init init) {
+    vgm_player* player = create(options);
+    if (!player) {
+        if (error) *error = "out of memory";
+        return nullptr;
+    }
+    bool ok;
+    try {
+        ok = init(player->vgm, options ? options->loop_count : 1);
+    }
+    catch (std::bad_alloc const&) {
+        if (error) *error = "out of memory";
+        vgm_close(player);
+        return nullptr;
+    }
+    if (!ok) {
+        // the message lives in the player, which is about to go away
+        static thread_local char message[64];
+        snprintf(message, sizeof(message), "%s", player->vgm.error());
+        if (error) *error = message;
+        vgm_close(player);
+        return nullptr;
+    }
+    VGM::Info const& i = player->vgm.info();
+    player->info = {
+        i.version, i.total_samples, i.loop_samples, i.volume,
+        i.ym2612_clock, i.ym2151_clock, i.ym2203_clock, i.rf5c68_clock, i.ga20_clock, i.lr35902_clock,
+        i.title.c_str(), i.game.c_str(), i.system.c_str(), i.author.c_str(), i.date.c_str(),
+    };
+    return player;
+}
+
+// nothing may throw through the C API. a player that ran out of memory is left
+// in an unknown state, so it only renders silence from then on
+template<class T>
+static uint32_t render(vgm_player* player, T* buffer, uint32_t frames) {
+    if (!player->failed) {
+        try {
+            return player->vgm.render(buffer, frames);
+        }
+        catch (std::bad_alloc const&) {
+            player->failed = true;
+        }
+    }
+    std::fill_n(buffer, frames * 2, T(0));
+    return 0;
+}
+
+
+extern "C" {
+
+void vgm_default_options(vgm_options* options) {
+    options->loop_count = 1;
+    options->quality    = 1;
+    options->allocator  = nullptr;
+}
+
+vgm_player* vgm_open_file(char const* filename, vgm_options const* options, char const** error) {
+    return open(options, error, [&](VGM& vgm, int loop_count) {
+        return vgm.init(filename, loop_count);
+    });
+}
+
+vgm_player* vgm_open_memory(void const* data, size_t size, vgm_options const* options, char const** error) {
+    return open(options, error, [&](VGM& vgm, int loop_count) {
+        return vgm.init(data, size, loop_count);
+    });
+}
+
+void vgm_close(vgm_player* player) {
+    if (!player) return;
+    vgm_allocator allocator = player->resource.allocator();
+    player->~vgm_player();
+    allocator.free(allocator.user, player, sizeof(vgm_player), alignof(vgm_player));
+}
+
+uint32_t vgm_render(vgm_player* player, float* buffer, uint32_t frames) {
+    return render(player, buffer, frames);
+}
+
+uint32_t vgm_render_int16(vgm_player* player, int16_t* buffer, uint32_t frames) {
+    return render(player, buffer, frames);
+}
+
+int vgm_done(vgm_player const* player) {
+    return player->failed || player->vgm.done();
+}
+
+int vgm_seek(vgm_player* player, uint64_t frame) {
+    if (player->failed) return -1;
+    try {
+        player->vgm.seek(frame);
+    }
+    catch (std::bad_alloc const&) {
+        player->failed = true;
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t vgm_tell(vgm_player const* player) {
+    return player->vgm.position();
+}
+
+vgm_info const* vgm_get_info(vgm_player const* player) {
+    return &player->info;
+}
+
+void vgm_print_log(vgm_player* player) {
+    if (player) player->vgm.log().drain();
+}
+
+} // extern "C"
@@ -0,0 +1,90 @@
+/* C API of libvgmplayer.
+ *
+ * Players are independent of each other: different players can be used from
+ * different threads at the same time, but a single player must only be used
+ * by one thread at a time. Output is interleaved stereo at VGM_SAMPLE_RATE.
+ */
+#ifndef VGMPLAYER_H
+#define VGMPLAYER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum { VGM_SAMPLE_RATE = 44100 };
+
+typedef struct vgm_player vgm_player;
+
+/* all memory of a player, including the song data, comes from its allocator.
+ * (the player's mixer settings, stems and loop snapshots use the default heap,
+ * but none of them are used through this API.) if the allocator runs out
+ * while rendering or seeking, the player fails: see vgm_render */
+typedef struct vgm_allocator {
+    void* (*alloc)(void* user, size_t size, size_t align);
+    void  (*free)(void* user, void* ptr, size_t size, size_t align);
+    void*   user;
+} vgm_allocator;
+
+typedef struct vgm_options {
+    int                  loop_count; /* number of times the song is played */
+    int                  quality;    /* 0 (simple ym2203) to 3 (best), 1 is the default */
+    vgm_allocator const* allocator;  /* null for the default allocator */
+} vgm_options;
+
+typedef struct vgm_info {
+    uint32_t    version;
+    uint32_t    total_samples;
+    uint32_t    loop_samples;
+    float       volume;
+    uint32_t    ym2612_clock;
+    uint32_t    ym2151_clock;
+    uint32_t    ym2203_clock;
+    uint32_t    rf5c68_clock;
+    uint32_t    ga20_clock;
+    uint32_t    lr35902_clock;
+    /* from the GD3 tag, UTF-8, empty if missing */
+    char const* title;
+    char const* game;
+    char const* system;
+    char const* author;
+    char const* date;
+} vgm_info;
+
+void vgm_default_options(vgm_options* options);
+
+/* options may be null. on failure, null is returned and *error, if given,
+ * points to a static description of the problem */
+vgm_player* vgm_open_file(char const* filename, vgm_options const* options, char const** error);
+vgm_player* vgm_open_memory(void const* data, size_t size, vgm_options const* options, char const** error);
+void        vgm_close(vgm_player* player);
+
+/* render frames into buffer and return the number of frames rendered
+ * before the song ended. the rest of the buffer is filled with silence.
+ * a player that ran out of memory renders silence and is done */
+uint32_t vgm_render(vgm_player* player, float* buffer, uint32_t frames);
+uint32_t vgm_render_int16(vgm_player* player, int16_t* buffer, uint32_t frames);
+int      vgm_done(vgm_player const* player);
+
+/* position in frames. seeking backwards replays the song from the start.
+ * returns 0, or -1 if the player ran out of memory */
+int      vgm_seek(vgm_player* player, uint64_t frame);
+uint64_t vgm_tell(vgm_player const* player);
+
+/* valid until vgm_close */
+vgm_info const* vgm_get_info(vgm_player const* player);
+
+/* messages like "looping" or warnings about unsupported features are queued
+ * in the player without blocking while rendering. the queue holds 256 of them,
+ * and later ones are counted and dropped until this prints the pending ones to
+ * stdout. it may run on another thread while the player renders, but not on
+ * two threads at once for the same player. a null player is ignored */
+void vgm_print_log(vgm_player* player);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
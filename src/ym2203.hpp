@@ -4,12 +4,23 @@
 #include <cmath>
 #include <algorithm>
 
+#include "log.hpp"
+
 
 class YM2203 {
 public:
-    enum { MIXRATE = 44100 };
+    enum { MIXRATE = 44100, CHANNELS = 6 };
 
     void set_clock(uint32_t clock) { m_cps = clock * (1.0f / MIXRATE); }
+    // where warnings go, by default the global log_queue
+    void set_log(LogQueue* log) { m_log = log; }
+    void reset() {
+        float     cps = m_cps;
+        LogQueue* log = m_log;
+        *this = YM2203();
+        m_cps = cps;
+        m_log = log;
+    }
 
     void write_reg(uint8_t a, uint8_t v) {
         m_reg[a] = v;
@@ -72,11 +83,12 @@ public:
                 int sus = (v >> 4) & 0xf;
                 op.sus_level = std::pow(0.707f, sus < 15 ? sus : 31);
             }
-            if (a >= 0x90 && (v & 8)) printf("warning: SSG EG not supported (%02x:%02x)\n", a, v);
+            if (a >= 0x90 && (v & 8)) m_log->push("warning: SSG EG not supported (%02x:%02x)\n", a, v, 0, 0);
         }
     }
 
-    void render(float out[2]) {
+    // chan_out, if given, receives the stereo output of each channel: ssg 0-2, then fm 0-2
+    void render(float out[2], float* chan_out = nullptr) {
         if (m_cps == 0.0f) return;
 
         static constexpr float PAN_SSG[] = {
@@ -104,8 +116,14 @@ public:
             int   tone  = chan.tone_en  & (chan.count * 2 >= chan.period);
             int   noise = chan.noise_en & !(m_noise_state & 1);
             float x     = (chan.tone_en | chan.noise_en) ? (tone | noise ? 1.0f : -1.0f) : 0.0f;
-            out[0] += x * chan.volume * PAN_SSG[c];
-            out[1] += x * chan.volume * PAN_SSG[2 - c];
+            float l = x * chan.volume * PAN_SSG[c];
+            float r = x * chan.volume * PAN_SSG[2 - c];
+            out[0] += l;
+            out[1] += r;
+            if (chan_out) {
+                chan_out[c * 2 + 0] = l;
+                chan_out[c * 2 + 1] = r;
+            }
         }
 
         // fm
@@ -156,6 +174,10 @@ public:
             a[3] += chan.ops[3].sample(a[2]);
             out[0] += a[3] * PAN_FM[c];
             out[1] += a[3] * PAN_FM[2 - c];
+            if (chan_out) {
+                chan_out[6 + c * 2 + 0] = a[3] * PAN_FM[c];
+                chan_out[6 + c * 2 + 1] = a[3] * PAN_FM[2 - c];
+            }
         }
     }
 private:
@@ -197,4 +219,5 @@ private:
     FmChan   m_fm_chans[3]  = {};
     int      m_ch3_freq[3]  = {}; // per-op freqs for ch2 3-op special mode
     bool     m_ch3_special  = false;
+    LogQueue* m_log         = &log_queue;
 };